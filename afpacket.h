@@ -0,0 +1,348 @@
+/**********************************************************************
+ afpacket.h - AF_PACKET TPACKET_V3 memory-mapped ring capture for pping
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ The kernel fills fixed-size blocks of the ring with as many frames as
+ fit (or until the block timeout expires) and hands whole blocks to
+ user space, so there is one poll() per block rather than a syscall and
+ a copy per packet. Frames are handed to the caller in place, as a
+ pointer into the ring, and the block is returned to the kernel once
+ all its frames have been processed.
+
+ The pcap filter expression is compiled with libpcap and attached to the
+ socket as a classic BPF program; its return value (the snap length)
+ limits how much of each packet is copied into the ring.
+
+ With hwTimestamps the adapter is set to timestamp every frame it
+ receives and the ring carries those timestamps (in the adapter's
+ clock, which should be kept in step with the system's, e.g. by
+ phc2sys).
+
+ An afPacketCounter counts the packets a filter accepts without taking
+ them in: its socket's receive buffer is left to fill up, after which
+ the kernel drops each accepted packet (and counts it) right after
+ running the filter, before any copy.
+
+  ***********************************************************************/
+
+#ifndef PPING_AFPACKET_H
+#define PPING_AFPACKET_H
+
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pcap.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#define AF_BURST 64         // most frames handed over at a time
+
+// A captured frame. 'data' points into the capture buffer and is only
+// valid for the duration of the callback it's passed to.
+struct frameSpan
+{
+    const uint8_t* data;
+    uint32_t caplen;    // bytes available at data
+    uint32_t len;       // length of the packet on the wire
+    int64_t sec;        // capture time
+    int64_t nsec;
+};
+
+// Compile pcap filter 'filter' (for Ethernet frames) and attach it to
+// packet socket 'fd'. Throws std::runtime_error if it doesn't compile;
+// otherwise returns setsockopt()'s result.
+static inline int attachPcapFilter(int fd, const std::string& filter, int snapLen)
+{
+    pcap_t* pd = pcap_open_dead(DLT_EN10MB, snapLen);
+    struct bpf_program prog;
+    if (pcap_compile(pd, &prog, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN) < 0) {
+        std::string err = pcap_geterr(pd);
+        pcap_close(pd);
+        throw std::runtime_error("bad filter '" + filter + "': " + err);
+    }
+    struct sock_fprog fprog;
+    fprog.len = prog.bf_len;
+    fprog.filter = reinterpret_cast<struct sock_filter*>(prog.bf_insns);
+    int r = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+    pcap_freecode(&prog);
+    pcap_close(pd);
+    return r;
+}
+
+// Bind packet socket 'fd' to interface 'ifname'; -1 (errno set) on failure
+static inline int bindPacketSocket(int fd, const std::string& ifname)
+{
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = if_nametoindex(ifname.c_str());
+    if (sll.sll_ifindex == 0) {
+        return -1;
+    }
+    return bind(fd, reinterpret_cast<struct sockaddr*>(&sll), sizeof(sll));
+}
+
+struct afPacketConfig
+{
+    uint32_t blockSize = 1 << 20;   // bytes per ring block
+    uint32_t frames = 1 << 18;      // (snap length sized) frames in the ring
+    uint32_t blockTimeout = 10;     // ms until a partly filled block is retired
+    bool hwTimestamps = false;      // frames timestamped by the adapter
+};
+
+class afPacketRing
+{
+  public:
+    afPacketRing(const std::string& ifname, const std::string& filter,
+                 int snapLen, const afPacketConfig& cfg)
+    {
+        fd_ = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+        if (fd_ < 0) {
+            fail("socket");
+        }
+        int ver = TPACKET_V3;
+        if (setsockopt(fd_, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0) {
+            fail("PACKET_VERSION");
+        }
+
+        // Frames in a V3 ring are variable length; the frame size only
+        // matters for sizing. Use one big enough for a snap length packet.
+        uint32_t frameSize = TPACKET_ALIGN(TPACKET3_HDRLEN + snapLen + 16);
+        uint32_t perBlock = cfg.blockSize / frameSize;
+        if (perBlock == 0 || cfg.blockSize % getpagesize() != 0) {
+            close(fd_);
+            throw std::runtime_error("ring block size must be a multiple of "
+                                     "the page size and hold at least one frame");
+        }
+        struct tpacket_req3 req;
+        memset(&req, 0, sizeof(req));
+        req.tp_block_size = cfg.blockSize;
+        req.tp_block_nr = (cfg.frames + perBlock - 1) / perBlock;
+        req.tp_frame_size = frameSize;
+        req.tp_frame_nr = perBlock * req.tp_block_nr;
+        req.tp_retire_blk_tov = cfg.blockTimeout;
+        if (setsockopt(fd_, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+            fail("PACKET_RX_RING");
+        }
+        nBlocks_ = req.tp_block_nr;
+        blockSize_ = req.tp_block_size;
+        mapLen_ = size_t(nBlocks_) * blockSize_;
+        void* m = mmap(nullptr, mapLen_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd_, 0);
+        if (m == MAP_FAILED) {
+            fail("mmap");
+        }
+        map_ = static_cast<uint8_t*>(m);
+
+        if (attachPcapFilter(fd_, filter, snapLen) < 0) {
+            fail("SO_ATTACH_FILTER");
+        }
+        if (bindPacketSocket(fd_, ifname) < 0) {
+            fail("bind");
+        }
+        if (cfg.hwTimestamps) {
+            enableHwTimestamps(ifname);
+        }
+    }
+
+    ~afPacketRing()
+    {
+        if (map_) {
+            munmap(map_, mapLen_);
+        }
+        close(fd_);
+    }
+    afPacketRing(const afPacketRing&) = delete;
+    afPacketRing& operator=(const afPacketRing&) = delete;
+
+    // Hand the frames of the next filled block to
+    // fn(const frameSpan* frames, size_t n), up to 'maxBurst' (at most
+    // AF_BURST) at a time, waiting up to 'timeoutMs' for one. Returns
+    // false if fn() asked to stop (by returning false); the rest of that
+    // block is then skipped.
+    template <class Fn>
+    bool next(int timeoutMs, size_t maxBurst, Fn fn)
+    {
+        auto* bd = reinterpret_cast<struct tpacket_block_desc*>(
+                       map_ + size_t(cur_) * blockSize_);
+        if ((blockStatus(bd) & TP_STATUS_USER) == 0) {
+            struct pollfd pfd = {fd_, POLLIN | POLLERR, 0};
+            poll(&pfd, 1, timeoutMs);
+            return true;
+        }
+
+        bool more = true;
+        uint32_t n = bd->hdr.bh1.num_pkts;
+        auto* p = reinterpret_cast<const uint8_t*>(bd) +
+                  bd->hdr.bh1.offset_to_first_pkt;
+        frameSpan burst[AF_BURST];
+        for (uint32_t i = 0; i < n && more; ) {
+            size_t max = std::min<size_t>(maxBurst, AF_BURST);
+            size_t k = 0;
+            for (; k < max && i < n; k++, i++) {
+                auto* hdr = reinterpret_cast<const struct tpacket3_hdr*>(p);
+                burst[k] = frameSpan{p + hdr->tp_mac, hdr->tp_snaplen,
+                                     hdr->tp_len, hdr->tp_sec, hdr->tp_nsec};
+                p += hdr->tp_next_offset;
+            }
+            more = fn(burst, k);
+        }
+
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                         __ATOMIC_RELEASE);
+        cur_ = (cur_ + 1) % nBlocks_;
+        return more;
+    }
+
+    // whether the next block is filled (next() won't wait)
+    bool ready() const
+    {
+        auto* bd = reinterpret_cast<struct tpacket_block_desc*>(
+                       map_ + size_t(cur_) * blockSize_);
+        return (blockStatus(bd) & TP_STATUS_USER) != 0;
+    }
+
+    // the socket, to poll() along with other capture handles
+    int fd() const { return fd_; }
+
+    // packets received / dropped by the kernel since the previous call
+    void stats(uint64_t& pkts, uint64_t& drops)
+    {
+        struct tpacket_stats_v3 st;
+        socklen_t len = sizeof(st);
+        memset(&st, 0, sizeof(st));
+        getsockopt(fd_, SOL_PACKET, PACKET_STATISTICS, &st, &len);
+        pkts = st.tp_packets;
+        drops = st.tp_drops;
+    }
+
+  private:
+    static uint32_t blockStatus(struct tpacket_block_desc* bd)
+    {
+        return __atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+    }
+
+    void enableHwTimestamps(const std::string& ifname)
+    {
+        // receive timestamps for all frames, leaving the rest of the
+        // adapter's setup (e.g. transmit timestamps for PTP) alone
+        struct hwtstamp_config hc;
+        memset(&hc, 0, sizeof(hc));
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, ifname.c_str(), sizeof(ifr.ifr_name) - 1);
+        ifr.ifr_data = reinterpret_cast<char*>(&hc);
+        if (ioctl(fd_, SIOCGHWTSTAMP, &ifr) < 0) {
+            memset(&hc, 0, sizeof(hc));
+            hc.tx_type = HWTSTAMP_TX_OFF;
+        }
+        if (hc.rx_filter != HWTSTAMP_FILTER_ALL) {
+            hc.rx_filter = HWTSTAMP_FILTER_ALL;
+            if (ioctl(fd_, SIOCSHWTSTAMP, &ifr) < 0) {
+                fail("SIOCSHWTSTAMP");
+            }
+        }
+        int req = SOF_TIMESTAMPING_RAW_HARDWARE;
+        if (setsockopt(fd_, SOL_PACKET, PACKET_TIMESTAMP, &req, sizeof(req)) < 0) {
+            fail("PACKET_TIMESTAMP");
+        }
+    }
+
+    [[noreturn]] void fail(const char* what)
+    {
+        std::string err = std::string(what) + ": " + strerror(errno);
+        if (map_) {
+            munmap(map_, mapLen_);
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+        throw std::runtime_error(err);
+    }
+
+    int fd_{-1};
+    uint8_t* map_{};
+    size_t mapLen_{};
+    uint32_t nBlocks_{};
+    uint32_t blockSize_{};
+    uint32_t cur_{};
+};
+
+class afPacketCounter
+{
+  public:
+    // count the packets of 'ifname' that pcap filter 'filter' accepts;
+    // throws std::runtime_error
+    afPacketCounter(const std::string& ifname, const std::string& filter)
+    {
+        fd_ = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+        if (fd_ < 0) {
+            fail("socket");
+        }
+        int sz = 0;     // (raised to the kernel's minimum)
+        setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+        int r;
+        try {
+            r = attachPcapFilter(fd_, filter, 1);
+        } catch (std::runtime_error&) {
+            close(fd_);
+            throw;
+        }
+        if (r < 0) {
+            fail("SO_ATTACH_FILTER");
+        }
+        if (bindPacketSocket(fd_, ifname) < 0) {
+            fail("bind");
+        }
+        count();        // (drop what other interfaces gave before the bind)
+    }
+
+    ~afPacketCounter()
+    {
+        close(fd_);
+    }
+    afPacketCounter(const afPacketCounter&) = delete;
+    afPacketCounter& operator=(const afPacketCounter&) = delete;
+
+    // packets accepted since the previous call
+    uint64_t count()
+    {
+        struct tpacket_stats st;
+        socklen_t len = sizeof(st);
+        memset(&st, 0, sizeof(st));
+        getsockopt(fd_, SOL_PACKET, PACKET_STATISTICS, &st, &len);
+        return st.tp_packets;   // (which the kernel's drops are added to)
+    }
+
+  private:
+    [[noreturn]] void fail(const char* what)
+    {
+        std::string err = std::string(what) + ": " + strerror(errno);
+        close(fd_);
+        throw std::runtime_error(err);
+    }
+
+    int fd_{-1};
+};
+
+#endif
@@ -0,0 +1,250 @@
+/**********************************************************************
+ bench.h - in-memory packet traces for pping-exporter's bench mode
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ A benchTrace holds a whole capture in memory so it can be replayed
+ through the packet path without any I/O. It's either read from a
+ capture file or generated:
+  - "bulk":     one long transfer, full-size data segments one way and
+                an ACK per two segments back
+  - "short":    many short connections (handshake, request, response,
+                FIN) from different clients, overlapping in time
+  - "synflood": SYNs from random sources and ports, never answered
+ Generated frames are Ethernet/IPv4/TCP with a timestamp option, cut at
+ the TCP header (the IP length gives their wire size) with a 1 ms TSval
+ clock, 10 ms from each end to the capture point.
+
+ latencySamples collects per-packet processing times for percentiles,
+ keeping every n'th one once more than a set number have been seen.
+
+  ***********************************************************************/
+
+#ifndef PPING_BENCH_H
+#define PPING_BENCH_H
+
+#include <pcap.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "capfile.h"
+
+struct benchFrame
+{
+    size_t off;         // into the trace's data
+    uint32_t caplen;
+    int64_t sec;
+    int64_t nsec;
+};
+
+class benchTrace
+{
+  public:
+    // read all of capture file 'fname' (see capFile); throws
+    // std::runtime_error
+    void load(const std::string& fname)
+    {
+        capFile cf(fname);
+        dlt_ = cf.dlt();
+        capFrame f;
+        while (cf.next(f)) {
+            add(f.data, f.caplen, f.sec, f.nsec);
+        }
+    }
+
+    // generate about 'nPkts' packets of trace 'kind' (see above); throws
+    // std::invalid_argument for an unknown kind
+    void generate(const std::string& kind, size_t nPkts)
+    {
+        dlt_ = DLT_EN10MB;
+        std::mt19937 rnd(1);
+        if (kind == "bulk") {
+            // client 10.0.0.1:40000 <- server 10.0.1.1:443
+            conn c{0x0a000001, 0x0a000101, 40000, 443};
+            handshake(c, 0.);
+            double t = 0.0201;
+            for (size_t i = 0; frames_.size() < nPkts; i++) {
+                tcp(t, c, false, 0x10, 1448);
+                if (i % 2 == 1) {
+                    tcp(t + 6e-6, c, true, 0x10, 0);
+                }
+                t += 12e-6;     // ~1 Gb/s
+            }
+        } else if (kind == "short") {
+            // a new connection every 50us, each lasting ~25ms
+            double t = 0.;
+            for (uint32_t i = 0; frames_.size() < nPkts; i++) {
+                conn c{0x0a000000 + uint32_t(rnd() & 0xffff), 0x0a010101,
+                       uint16_t(1024 + (i % 60000)), 80};
+                handshake(c, t);
+                tcp(t + 0.021, c, true, 0x18, 200);         // request
+                tcp(t + 0.041, c, false, 0x18, 1200);       // response
+                tcp(t + 0.062, c, true, 0x11, 0);           // FIN
+                t += 50e-6;
+            }
+            sortByTime();
+        } else if (kind == "synflood") {
+            double t = 0.;
+            while (frames_.size() < nPkts) {
+                conn c{uint32_t(rnd()), 0x0a010101, uint16_t(rnd()), 80};
+                c.tsBase[0] = uint32_t(rnd());
+                tcp(t, c, true, 0x02, 0);
+                t += 2e-6;
+            }
+        } else {
+            throw std::invalid_argument("unknown trace " + kind);
+        }
+    }
+
+    int dlt() const { return dlt_; }
+    size_t size() const { return frames_.size(); }
+    const benchFrame& operator[](size_t i) const { return frames_[i]; }
+    const uint8_t* data(const benchFrame& f) const { return data_.data() + f.off; }
+
+    // seconds from the first to the last packet
+    double span() const
+    {
+        if (frames_.empty()) {
+            return 0.;
+        }
+        const benchFrame& a = frames_.front();
+        const benchFrame& b = frames_.back();
+        return double(b.sec - a.sec) + double(b.nsec - a.nsec) * 1e-9;
+    }
+
+  private:
+    struct conn
+    {
+        uint32_t cli, srv;      // IPv4 addresses, host order
+        uint16_t cport, sport;
+        uint32_t tsBase[2] {1000000, 5000000};  // client, server TSval clocks
+    };
+
+    void add(const uint8_t* p, uint32_t len, int64_t sec, int64_t nsec)
+    {
+        frames_.push_back(benchFrame{data_.size(), len, sec, nsec});
+        data_.insert(data_.end(), p, p + len);
+    }
+
+    void handshake(const conn& c, double t)
+    {
+        tcp(t, c, true, 0x02, 0);
+        tcp(t + 0.020, c, false, 0x12, 0);
+        tcp(t + 0.020 + 50e-6, c, true, 0x10, 0);
+    }
+
+    // a packet of 'c' (from the client if 'fromCli') seen at time 't'.
+    // The capture point is 10ms from each end and both TSval clocks
+    // tick every ms, so the echoed TSval is the peer's from 20ms ago.
+    void tcp(double t, const conn& c, bool fromCli, uint8_t flags,
+             uint32_t payload)
+    {
+        const double owd = 0.010;
+        int me = fromCli ? 0 : 1;
+        uint32_t tsval = c.tsBase[me] + uint32_t((t + 1.) * 1000.);
+        uint32_t ecr = (flags == 0x02) ? 0 :
+                       c.tsBase[1 - me] + uint32_t((t + 1. - 2 * owd) * 1000.);
+
+        uint8_t f[66] = {};
+        f[12] = 0x08;                               // Ethernet, IPv4
+        uint8_t* ip = f + 14;
+        ip[0] = 0x45;
+        wr16(ip + 2, uint16_t(20 + 32 + payload));
+        ip[8] = 64;
+        ip[9] = 6;
+        wr32(ip + 12, fromCli ? c.cli : c.srv);
+        wr32(ip + 16, fromCli ? c.srv : c.cli);
+        uint8_t* th = ip + 20;
+        wr16(th, fromCli ? c.cport : c.sport);
+        wr16(th + 2, fromCli ? c.sport : c.cport);
+        th[12] = 8 << 4;                            // 32 byte header
+        th[13] = flags;
+        wr16(th + 14, 65535);
+        th[20] = 1;                                 // NOP, NOP, TS
+        th[21] = 1;
+        th[22] = 8;
+        th[23] = 10;
+        wr32(th + 24, tsval);
+        wr32(th + 28, ecr);
+
+        int64_t us = int64_t(t * 1e6) + 1600000000LL * 1000000;
+        add(f, sizeof(f), us / 1000000, us % 1000000 * 1000);
+    }
+
+    void sortByTime()
+    {
+        std::vector<uint8_t> data;
+        data.swap(data_);
+        std::vector<benchFrame> frames;
+        frames.swap(frames_);
+        std::stable_sort(frames.begin(), frames.end(),
+                         [](const benchFrame& a, const benchFrame& b) {
+                             return a.sec != b.sec ? a.sec < b.sec : a.nsec < b.nsec;
+                         });
+        for (const auto& fr : frames) {
+            add(data.data() + fr.off, fr.caplen, fr.sec, fr.nsec);
+        }
+    }
+
+    static void wr16(uint8_t* p, uint16_t v)
+    {
+        p[0] = uint8_t(v >> 8);
+        p[1] = uint8_t(v);
+    }
+
+    static void wr32(uint8_t* p, uint32_t v)
+    {
+        wr16(p, uint16_t(v >> 16));
+        wr16(p + 2, uint16_t(v));
+    }
+
+    int dlt_{DLT_EN10MB};
+    std::vector<uint8_t> data_;
+    std::vector<benchFrame> frames_;
+};
+
+class latencySamples
+{
+  public:
+    // expect 'total' samples and keep at most about 'maxKept' of them
+    latencySamples(uint64_t total, size_t maxKept)
+        : every_{std::max<uint64_t>(1, (total + maxKept - 1) / maxKept)}
+    {
+        v_.reserve(std::min<uint64_t>(total, maxKept) + 1);
+    }
+
+    void add(uint32_t ns)
+    {
+        if (n_++ % every_ == 0) {
+            v_.push_back(ns);
+        }
+    }
+
+    // 'q' (0-1) quantile of the kept samples
+    uint32_t quantile(double q)
+    {
+        if (v_.empty()) {
+            return 0;
+        }
+        size_t i = std::min(v_.size() - 1, size_t(q * v_.size()));
+        std::nth_element(v_.begin(), v_.begin() + i, v_.end());
+        return v_[i];
+    }
+
+  private:
+    uint64_t every_;
+    uint64_t n_{};
+    std::vector<uint32_t> v_;
+};
+
+#endif
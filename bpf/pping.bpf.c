@@ -0,0 +1,360 @@
+/**********************************************************************
+ pping.bpf.c - in-kernel TSval matching for pping-exporter
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ A TC (clsact) classifier attached to both ingress and egress of the
+ capture interface (XDP only sees ingress, pping needs both directions).
+ It does what ppWorker::process() does in user space -- flow records,
+ saving the first capture time of each flow + TSval and matching it
+ against the ECR of the reverse flow -- and only pushes the resulting
+ RTT samples to the exporter through a ring buffer. Every packet is
+ passed on unchanged.
+
+ The flow and TSval tables are LRU hashes so there is no explicit clean
+ up: under pressure the least recently used entries go, and entries
+ older than tsvalMaxAge / flowMaxIdle are treated as absent (and
+ overwritten). As in user space, a matched TSval entry is marked used
+ rather than deleted.
+
+ Build with: clang -O2 -g -target bpf -c pping.bpf.c -o pping.bpf.o
+
+  ***********************************************************************/
+
+#include <linux/bpf.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "pping_bpf.h"
+
+#define MAX_VLAN 2
+#define MAX_TCP_OPTS 10
+#define MAX_V6_EXT 4      // IPv6 extension headers walked in front of TCP
+#define TCP_SYN_ONLY 0x02
+
+// sizes are set by the exporter before load (--maxFlows / --maxTsEntries)
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 10000);
+    __type(key, struct pp_flow_key);
+    __type(value, struct pp_flow_val);
+} flows SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 500000);
+    __type(key, struct pp_ts_key);
+    __type(value, struct pp_ts_val);
+} tsTbl SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, 256);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, struct pp_lpm_v4);
+    __type(value, __u8);
+} local4 SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, 256);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, struct pp_lpm_v6);
+    __type(value, __u8);
+} local6 SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct pp_config);
+} config SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, PP_NCOUNTERS);
+    __type(key, __u32);
+    __type(value, __u64);
+} counters SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 1 << 22);
+} samples SEC(".maps");
+
+static __always_inline void count(__u32 idx)
+{
+    __u64* c = bpf_map_lookup_elem(&counters, &idx);
+    if (c) {
+        (*c)++;
+    }
+}
+
+static __always_inline void setV4(__u8* a, __u32 ip)
+{
+    __builtin_memset(a, 0, 10);
+    a[10] = a[11] = 0xff;
+    __builtin_memcpy(a + 12, &ip, 4);
+}
+
+static __always_inline int isLocal(const struct pp_flow_key* k, int v4)
+{
+    if (v4) {
+        struct pp_lpm_v4 lk = {.prefixlen = 32};
+        __builtin_memcpy(lk.addr, k->dst + 12, 4);
+        return bpf_map_lookup_elem(&local4, &lk) != NULL;
+    }
+    struct pp_lpm_v6 lk = {.prefixlen = 128};
+    __builtin_memcpy(lk.addr, k->dst, 16);
+    return bpf_map_lookup_elem(&local6, &lk) != NULL;
+}
+
+SEC("tc")
+int pping_tc(struct __sk_buff* skb)
+{
+    // make sure the headers are in the linear part of the skb
+    bpf_skb_pull_data(skb, skb->len < 160 ? skb->len : 160);
+
+    void* data = (void*)(long)skb->data;
+    void* end = (void*)(long)skb->data_end;
+    struct pp_flow_key key, rkey;
+    __u32 wireLen;
+    int v4;
+
+    count(PP_PKTS);
+
+    struct ethhdr* eth = data;
+    if ((void*)(eth + 1) > end) {
+        count(PP_NOT_TCP);
+        return TC_ACT_OK;
+    }
+    __u16 proto = eth->h_proto;
+    void* l3 = eth + 1;
+#pragma unroll
+    for (int i = 0; i < MAX_VLAN; i++) {
+        if (proto != bpf_htons(ETH_P_8021Q) && proto != bpf_htons(ETH_P_8021AD)) {
+            break;
+        }
+        if (l3 + 4 > end) {
+            count(PP_NOT_TCP);
+            return TC_ACT_OK;
+        }
+        proto = *(__u16*)(l3 + 2);
+        l3 += 4;
+    }
+
+    struct tcphdr* tcp;
+    if (proto == bpf_htons(ETH_P_IP)) {
+        struct iphdr* ip = l3;
+        if ((void*)(ip + 1) > end || ip->protocol != IPPROTO_TCP ||
+              (ip->frag_off & bpf_htons(0x1fff)) != 0 || ip->ihl < 5) {
+            count(PP_NOT_TCP);
+            return TC_ACT_OK;
+        }
+        setV4(key.src, ip->saddr);
+        setV4(key.dst, ip->daddr);
+        wireLen = (l3 - data) + bpf_ntohs(ip->tot_len);
+        tcp = l3 + ip->ihl * 4;
+        v4 = 1;
+    } else if (proto == bpf_htons(ETH_P_IPV6)) {
+        struct ipv6hdr* ip6 = l3;
+        if ((void*)(ip6 + 1) > end) {
+            count(PP_NOT_TCP);
+            return TC_ACT_OK;
+        }
+        // skip the common extension headers in front of TCP (as
+        // tcpparse.h does, but only so many for the verifier)
+        __u8 nh = ip6->nexthdr;
+        __u8* eh = (__u8*)(ip6 + 1);
+#pragma unroll
+        for (int i = 0; i < MAX_V6_EXT; i++) {
+            if (nh == IPPROTO_TCP || (void*)(eh + 8) > end) {
+                break;
+            }
+            __u8 next = eh[0];
+            if (nh == IPPROTO_HOPOPTS || nh == IPPROTO_ROUTING ||
+                nh == IPPROTO_DSTOPTS) {
+                eh += (eh[1] + 1) * 8;
+            } else if (nh == IPPROTO_FRAGMENT &&
+                       (*(__u16*)(eh + 2) & bpf_htons(0xfff8)) == 0) {
+                eh += 8;            // (the first fragment only)
+            } else if (nh == IPPROTO_AH) {
+                eh += (eh[1] + 2) * 4;
+            } else {
+                break;
+            }
+            nh = next;
+        }
+        if (nh != IPPROTO_TCP) {
+            count(PP_NOT_TCP);
+            return TC_ACT_OK;
+        }
+        __builtin_memcpy(key.src, &ip6->saddr, 16);
+        __builtin_memcpy(key.dst, &ip6->daddr, 16);
+        wireLen = (l3 - data) + sizeof(*ip6) + bpf_ntohs(ip6->payload_len);
+        tcp = (void*)eh;
+        v4 = 0;
+    } else {
+        count(PP_NOT_TCP);
+        return TC_ACT_OK;
+    }
+    if ((void*)(tcp + 1) > end) {
+        count(PP_NOT_TCP);
+        return TC_ACT_OK;
+    }
+
+    // find the timestamp option
+    __u32 tsval = 0, ecr = 0;
+    int found = 0;
+    __u8* opt = (__u8*)(tcp + 1);
+    __u8* optEnd = (__u8*)tcp + tcp->doff * 4;
+#pragma unroll
+    for (int i = 0; i < MAX_TCP_OPTS; i++) {
+        if (opt >= optEnd || (void*)(opt + 1) > end) {
+            break;
+        }
+        __u8 kind = opt[0];
+        if (kind == 0) {
+            break;
+        }
+        if (kind == 1) {
+            opt++;
+            continue;
+        }
+        if ((void*)(opt + 2) > end) {
+            break;
+        }
+        __u8 olen = opt[1];
+        if (kind == 8 && olen == 10) {
+            if ((void*)(opt + 10) > end) {
+                break;
+            }
+            __builtin_memcpy(&tsval, opt + 2, 4);
+            __builtin_memcpy(&ecr, opt + 6, 4);
+            tsval = bpf_ntohl(tsval);
+            ecr = bpf_ntohl(ecr);
+            found = 1;
+            break;
+        }
+        if (olen < 2) {
+            break;
+        }
+        opt += olen;
+    }
+    if (!found) {
+        count(PP_NO_TS);
+        return TC_ACT_OK;
+    }
+    __u8 flags = ((__u8*)tcp)[13];
+    if (tsval == 0 || (ecr == 0 && flags != TCP_SYN_ONLY)) {
+        return TC_ACT_OK;
+    }
+    key.sport = bpf_ntohs(tcp->source);
+    key.dport = bpf_ntohs(tcp->dest);
+
+    __u32 zero = 0;
+    struct pp_config* cfg = bpf_map_lookup_elem(&config, &zero);
+    if (!cfg) {
+        return TC_ACT_OK;
+    }
+    __u64 now = bpf_ktime_get_ns();
+
+    __builtin_memcpy(rkey.src, key.dst, 16);
+    __builtin_memcpy(rkey.dst, key.src, 16);
+    rkey.sport = key.dport;
+    rkey.dport = key.sport;
+
+    // flow record; an idle one is as good as gone
+    struct pp_flow_val* fr = bpf_map_lookup_elem(&flows, &key);
+    struct pp_flow_val* rr = bpf_map_lookup_elem(&flows, &rkey);
+    if (rr && now - rr->last > cfg->flowMaxIdle) {
+        rr = NULL;
+    }
+    if (!fr || now - fr->last > cfg->flowMaxIdle) {
+        struct pp_flow_val nf = {.min = ~0ULL};
+        if (rr) {
+            nf.revFlow = 1;
+            rr->revFlow = 1;
+        }
+        nf.last = now;
+        if (bpf_map_update_elem(&flows, &key, &nf, BPF_ANY) != 0) {
+            count(PP_FLOWS_FULL);
+            return TC_ACT_OK;
+        }
+        fr = bpf_map_lookup_elem(&flows, &key);
+        if (!fr) {
+            return TC_ACT_OK;
+        }
+    }
+    fr->last = now;
+    if (!fr->revFlow) {
+        count(PP_UNIDIR);
+        return TC_ACT_OK;
+    }
+
+    __u64 arr_fwd = __sync_fetch_and_add(&fr->bytesSnt, wireLen) + wireLen;
+    if (!cfg->filtLocal || !isLocal(&key, v4)) {
+        struct pp_ts_key tk;
+        __builtin_memcpy(&tk.flow, &key, sizeof(key));
+        tk.tsval = tsval;
+        struct pp_ts_val tv = {.t = now, .fBytes = arr_fwd, .dBytes = fr->bytesDep};
+        if (bpf_map_update_elem(&tsTbl, &tk, &tv, BPF_NOEXIST) != 0) {
+            // already there; replace it only if it's from an old
+            // incarnation of this TSval
+            struct pp_ts_val* old = bpf_map_lookup_elem(&tsTbl, &tk);
+            if (old && now - old->t > cfg->tsvalMaxAge) {
+                bpf_map_update_elem(&tsTbl, &tk, &tv, BPF_EXIST);
+            }
+        }
+    }
+
+    struct pp_ts_key ek;
+    __builtin_memcpy(&ek.flow, &rkey, sizeof(rkey));
+    ek.tsval = ecr;
+    struct pp_ts_val* ti = bpf_map_lookup_elem(&tsTbl, &ek);
+    if (!ti || now - ti->t > cfg->tsvalMaxAge ||
+          __sync_lock_test_and_set(&ti->used, 1) != 0) {
+        return TC_ACT_OK;
+    }
+
+    // this packet is the return "pping" -- process it for packet's src
+    __u64 rtt = now - ti->t;
+    if (fr->min > rtt) {
+        fr->min = rtt;
+    }
+    __u64 pBytes = arr_fwd - fr->lstBytesSnt;
+    fr->lstBytesSnt = arr_fwd;
+    if (rr) {
+        rr->bytesDep = ti->fBytes;
+    }
+
+    struct pp_sample* s = bpf_ringbuf_reserve(&samples, sizeof(*s), 0);
+    if (!s) {
+        count(PP_SAMPLES_LOST);
+        return TC_ACT_OK;
+    }
+    __builtin_memcpy(&s->flow, &key, sizeof(key));
+    s->pad = 0;
+    s->ts = now;
+    s->rtt = rtt;
+    s->min = fr->min;
+    s->fBytes = ti->fBytes;
+    s->dBytes = ti->dBytes;
+    s->pBytes = pBytes;
+    bpf_ringbuf_submit(s, 0);
+
+    return TC_ACT_OK;
+}
+
+char LICENSE[] SEC("license") = "GPL";
@@ -0,0 +1,92 @@
+/**********************************************************************
+ pping_bpf.h - types shared by the pping eBPF program and the exporter
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+  ***********************************************************************/
+
+#ifndef PPING_BPF_H
+#define PPING_BPF_H
+
+#include <linux/types.h>
+
+// Same layout as the exporter's flowKey: IPv4 addresses are v4-mapped,
+// ports are in host byte order.
+struct pp_flow_key {
+    __u8 src[16];
+    __u8 dst[16];
+    __u16 sport;
+    __u16 dport;
+};
+
+struct pp_ts_key {
+    struct pp_flow_key flow;
+    __u32 tsval;
+};
+
+struct pp_ts_val {
+    __u64 t;            // capture time (ns, CLOCK_MONOTONIC) of first TSval pkt
+    __u64 fBytes;       // total bytes of flow through CP including this pkt
+    __u64 dBytes;
+    __u32 used;         // the kernel side of ti->t = -t
+    __u32 pad;
+};
+
+struct pp_flow_val {
+    __u64 last;         // ns
+    __u64 min;          // ns
+    __u64 bytesSnt;
+    __u64 lstBytesSnt;
+    __u64 bytesDep;
+    __u32 revFlow;
+    __u32 pad;
+};
+
+// an RTT sample, pushed to user space through the ring buffer
+struct pp_sample {
+    struct pp_flow_key flow;
+    __u32 pad;
+    __u64 ts;           // ns, CLOCK_MONOTONIC
+    __u64 rtt;          // ns
+    __u64 min;          // ns
+    __u64 fBytes;
+    __u64 dBytes;
+    __u64 pBytes;
+};
+
+struct pp_config {
+    __u64 tsvalMaxAge;  // ns
+    __u64 flowMaxIdle;  // ns
+    __u32 filtLocal;
+    __u32 pad;
+};
+
+// localRanges, as LPM trie keys
+struct pp_lpm_v4 {
+    __u32 prefixlen;
+    __u8 addr[4];
+};
+
+struct pp_lpm_v6 {
+    __u32 prefixlen;
+    __u8 addr[16];
+};
+
+// per-CPU counters
+enum {
+    PP_PKTS,
+    PP_NOT_TCP,
+    PP_NO_TS,
+    PP_NOT_V4OR6,
+    PP_UNIDIR,
+    PP_FLOWS_FULL,
+    PP_SAMPLES_LOST,
+    PP_NCOUNTERS
+};
+
+#endif
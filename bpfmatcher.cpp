@@ -0,0 +1,180 @@
+/**********************************************************************
+ bpfmatcher.cpp - loader for pping's in-kernel TSval matching (eBPF mode)
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+  ***********************************************************************/
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <net/if.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "bpfmatcher.h"
+
+static struct bpf_tc_hook tcHook(int ifindex, int attachPoint)
+{
+    struct bpf_tc_hook hook;
+    memset(&hook, 0, sizeof(hook));
+    hook.sz = sizeof(hook);
+    hook.ifindex = ifindex;
+    hook.attach_point = static_cast<enum bpf_tc_attach_point>(attachPoint);
+    return hook;
+}
+
+// our filter is always handle 1, priority 1
+static struct bpf_tc_opts tcOpts(int progFd)
+{
+    struct bpf_tc_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.sz = sizeof(opts);
+    opts.handle = 1;
+    opts.priority = 1;
+    opts.prog_fd = progFd;
+    return opts;
+}
+
+bpfMatcher::bpfMatcher(const std::string& objPath, const std::string& ifname,
+                       uint32_t maxFlows, uint32_t maxTsEntries,
+                       const struct pp_config& cfg, sampleFn fn)
+    : onSample_{fn}
+{
+    ifindex_ = if_nametoindex(ifname.c_str());
+    if (ifindex_ == 0) {
+        throw std::runtime_error("unknown interface " + ifname);
+    }
+    obj_ = bpf_object__open_file(objPath.c_str(), nullptr);
+    if (libbpf_get_error(obj_)) {
+        obj_ = nullptr;
+        throw std::runtime_error("can't open " + objPath);
+    }
+    struct bpf_map* flows = bpf_object__find_map_by_name(obj_, "flows");
+    struct bpf_map* tsTbl = bpf_object__find_map_by_name(obj_, "tsTbl");
+    if (!flows || !tsTbl ||
+        bpf_map__set_max_entries(flows, maxFlows) != 0 ||
+        bpf_map__set_max_entries(tsTbl, maxTsEntries) != 0 ||
+        bpf_object__load(obj_) != 0) {
+        fail("can't load " + objPath);
+    }
+
+    uint32_t zero = 0;
+    if (bpf_map_update_elem(mapFd("config"), &zero, &cfg, BPF_ANY) != 0) {
+        fail("can't set config");
+    }
+
+    struct bpf_program* prog = bpf_object__find_program_by_name(obj_, "pping_tc");
+    if (!prog) {
+        fail("no pping_tc program in " + objPath);
+    }
+    // there may already be a clsact qdisc; only remove it on exit if
+    // it was created here
+    auto hook = tcHook(ifindex_, BPF_TC_INGRESS | BPF_TC_EGRESS);
+    int err = bpf_tc_hook_create(&hook);
+    if (err != 0 && err != -EEXIST) {
+        fail("can't create clsact qdisc");
+    }
+    ownHook_ = (err == 0);
+    for (int ap : {BPF_TC_INGRESS, BPF_TC_EGRESS}) {
+        auto h = tcHook(ifindex_, ap);
+        auto opts = tcOpts(bpf_program__fd(prog));
+        if (bpf_tc_attach(&h, &opts) != 0) {
+            fail("can't attach TC program");
+        }
+        attached_.push_back(ap);
+    }
+
+    rb_ = ring_buffer__new(mapFd("samples"), &bpfMatcher::rbCallback, this, nullptr);
+    if (!rb_) {
+        fail("can't open sample ring buffer");
+    }
+    int n = libbpf_num_possible_cpus();
+    pcpu_.resize(n > 0 ? n : 1);
+}
+
+void bpfMatcher::addLocal(const uint8_t* addr, bool v6, uint32_t prefixLen)
+{
+    uint8_t one = 1;
+    if (v6) {
+        struct pp_lpm_v6 k;
+        k.prefixlen = prefixLen;
+        memcpy(k.addr, addr, 16);
+        bpf_map_update_elem(mapFd("local6"), &k, &one, BPF_ANY);
+    } else {
+        struct pp_lpm_v4 k;
+        k.prefixlen = prefixLen;
+        memcpy(k.addr, addr, 4);
+        bpf_map_update_elem(mapFd("local4"), &k, &one, BPF_ANY);
+    }
+}
+
+void bpfMatcher::poll(int timeoutMs)
+{
+    ring_buffer__poll(rb_, timeoutMs);
+}
+
+void bpfMatcher::counters(uint64_t out[PP_NCOUNTERS])
+{
+    int fd = mapFd("counters");
+    for (uint32_t i = 0; i < PP_NCOUNTERS; i++) {
+        out[i] = 0;
+        if (bpf_map_lookup_elem(fd, &i, pcpu_.data()) == 0) {
+            for (uint64_t v : pcpu_) {
+                out[i] += v;
+            }
+        }
+    }
+}
+
+int bpfMatcher::rbCallback(void* ctx, void* data, size_t len)
+{
+    if (len >= sizeof(struct pp_sample)) {
+        static_cast<bpfMatcher*>(ctx)->onSample_(
+            *static_cast<const struct pp_sample*>(data));
+    }
+    return 0;
+}
+
+int bpfMatcher::mapFd(const char* name)
+{
+    struct bpf_map* m = bpf_object__find_map_by_name(obj_, name);
+    if (!m) {
+        fail(std::string("no map ") + name);
+    }
+    return bpf_map__fd(m);
+}
+
+void bpfMatcher::cleanup()
+{
+    if (rb_) {
+        ring_buffer__free(rb_);
+        rb_ = nullptr;
+    }
+    for (int ap : attached_) {
+        auto h = tcHook(ifindex_, ap);
+        auto opts = tcOpts(0);
+        bpf_tc_detach(&h, &opts);
+    }
+    attached_.clear();
+    if (ownHook_) {
+        auto hook = tcHook(ifindex_, BPF_TC_INGRESS | BPF_TC_EGRESS);
+        bpf_tc_hook_destroy(&hook);
+        ownHook_ = false;
+    }
+    if (obj_) {
+        bpf_object__close(obj_);
+        obj_ = nullptr;
+    }
+}
+
+void bpfMatcher::fail(const std::string& what)
+{
+    cleanup();
+    throw std::runtime_error(what);
+}
@@ -0,0 +1,72 @@
+/**********************************************************************
+ bpfmatcher.h - loader for pping's in-kernel TSval matching (eBPF mode)
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ Loads bpf/pping.bpf.o, sizes its flow and TSval tables, fills in its
+ configuration and local address tries, attaches it to the TC ingress
+ and egress hooks of the capture interface, and hands the RTT samples
+ it produces to a callback. Requires libbpf >= 0.6; only built with
+ 'make BPF=1'.
+
+ The libbpf headers pull in <linux/bpf.h>, whose struct bpf_insn clashes
+ with libpcap's, so everything that needs them is in bpfmatcher.cpp.
+
+  ***********************************************************************/
+
+#ifndef PPING_BPFMATCHER_H
+#define PPING_BPFMATCHER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bpf/pping_bpf.h"
+
+struct bpf_object;
+struct ring_buffer;
+
+class bpfMatcher
+{
+  public:
+    typedef void (*sampleFn)(const struct pp_sample&);
+
+    // Throws std::runtime_error if the program can't be loaded or attached
+    bpfMatcher(const std::string& objPath, const std::string& ifname,
+               uint32_t maxFlows, uint32_t maxTsEntries,
+               const struct pp_config& cfg, sampleFn fn);
+    ~bpfMatcher() { cleanup(); }
+    bpfMatcher(const bpfMatcher&) = delete;
+    bpfMatcher& operator=(const bpfMatcher&) = delete;
+
+    // add a local (ignored) destination prefix; 'addr' is 4 or 16 bytes
+    void addLocal(const uint8_t* addr, bool v6, uint32_t prefixLen);
+
+    // deliver pending samples, waiting up to timeoutMs for some
+    void poll(int timeoutMs);
+
+    // totals of the kernel side counters (PP_*), summed over CPUs
+    void counters(uint64_t out[PP_NCOUNTERS]);
+
+  private:
+    static int rbCallback(void* ctx, void* data, size_t len);
+    int mapFd(const char* name);
+    void cleanup();
+    [[noreturn]] void fail(const std::string& what);
+
+    sampleFn onSample_;
+    int ifindex_{};
+    struct bpf_object* obj_{};
+    bool ownHook_{};
+    std::vector<int> attached_;     // TC attach points
+    struct ring_buffer* rb_{};
+    std::vector<uint64_t> pcpu_;
+};
+
+#endif
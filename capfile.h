@@ -0,0 +1,530 @@
+/**********************************************************************
+ capfile.h - fast reading of pcap / pcapng capture files
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ capFile hands out the frames of a capture file as byte spans, for the
+ raw parser, with no per-packet allocation or copy:
+  - an uncompressed file is mmap()ed and read in place, with
+    MADV_SEQUENTIAL and a MADV_WILLNEED hint for the next
+    CAPFILE_AHEAD bytes as it goes,
+  - a gzip (or, built with PPING_WITH_ZSTD, zstd) compressed one is
+    decompressed as it's read into a buffer the frames are handed out
+    of.
+ Both pcap (us or ns timestamps, either byte order) and pcapng (enhanced
+ and obsolete packet blocks, per-interface link types and timestamp
+ resolutions) are understood.
+
+ capFilter applies a pcap filter expression to such frames, as libpcap
+ would have when reading the file.
+
+  ***********************************************************************/
+
+#ifndef PPING_CAPFILE_H
+#define PPING_CAPFILE_H
+
+#include <fcntl.h>
+#include <pcap.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef PPING_WITH_ZSTD
+#include <zstd.h>
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define CAPFILE_AHEAD (8 << 20)     // readahead hint window, bytes
+#define CAPFILE_INBUF (256 << 10)   // compressed bytes read at a time
+
+struct capFrame
+{
+    const uint8_t* data;
+    uint32_t caplen;
+    uint32_t wireLen;
+    int dlt;
+    int64_t sec;
+    int64_t nsec;
+};
+
+class capFile
+{
+  public:
+    // throws std::runtime_error if 'name' can't be read or isn't a
+    // capture file
+    explicit capFile(const std::string& name) : name_{name}
+    {
+        fd_ = ::open(name.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd_ < 0 || fstat(fd_, &st) < 0) {
+            fail(strerror(errno));
+        }
+        uint8_t magic[4] = {};
+        if (pread(fd_, magic, sizeof(magic), 0) != sizeof(magic)) {
+            fail("too short to be a capture file");
+        }
+        if (magic[0] == 0x1f && magic[1] == 0x8b) {
+            comp_ = COMP_GZIP;
+            memset(&zs_, 0, sizeof(zs_));
+            if (inflateInit2(&zs_, 16 + MAX_WBITS) != Z_OK) {
+                fail("can't start gzip decompression");
+            }
+        } else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+                   magic[3] == 0xfd) {
+#ifdef PPING_WITH_ZSTD
+            comp_ = COMP_ZSTD;
+            zd_ = ZSTD_createDCtx();
+#else
+            fail("zstd compressed (not built with ZSTD=1)");
+#endif
+        } else if (st.st_size > 0) {
+            void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (m == MAP_FAILED) {
+                fail(strerror(errno));
+            }
+            map_ = static_cast<const uint8_t*>(m);
+            mapLen_ = st.st_size;
+            madvise(m, mapLen_, MADV_SEQUENTIAL);
+            p_ = map_;
+            nxtHint_ = map_;
+            end_ = map_ + mapLen_;
+        }
+        if (comp_ != COMP_NONE) {
+            posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+            in_.resize(CAPFILE_INBUF);
+        }
+        readHeader();
+    }
+
+    ~capFile() { release(); }
+
+    capFile(const capFile&) = delete;
+    capFile& operator=(const capFile&) = delete;
+
+    // link type of the (first) interface
+    int dlt() const { return ifs_.empty() ? DLT_EN10MB : ifs_[0].dlt; }
+
+    // The next frame, valid until the next call (or, if mapped(), for
+    // as long as the capFile); false at the end of the file (a truncated
+    // last record is dropped) or on a format error, which error() then
+    // describes.
+    bool next(capFrame& f)
+    {
+        return ng_ ? nextNg(f) : nextPcap(f);
+    }
+
+    const std::string& error() const { return err_; }
+
+    // read in place from a mapping of the file (not decompressed)
+    bool mapped() const { return map_ != nullptr; }
+
+  private:
+    enum compression { COMP_NONE, COMP_GZIP, COMP_ZSTD };
+
+    struct iface
+    {
+        int dlt;
+        uint64_t tsDiv;     // timestamp units per second
+    };
+
+    void release()
+    {
+        if (map_) {
+            munmap(const_cast<uint8_t*>(map_), mapLen_);
+        }
+        if (comp_ == COMP_GZIP) {
+            inflateEnd(&zs_);
+        }
+#ifdef PPING_WITH_ZSTD
+        if (zd_) {
+            ZSTD_freeDCtx(zd_);
+        }
+#endif
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+        map_ = nullptr;
+        comp_ = COMP_NONE;
+        fd_ = -1;
+    }
+
+    // (only from the constructor, so the destructor won't run)
+    void fail(const std::string& why)
+    {
+        release();
+        throw std::runtime_error(name_ + ": " + why);
+    }
+
+    // the file's link type values are LINKTYPE_*, which are the DLT_*
+    // ones but for raw IP
+    static int toDlt(uint32_t linktype)
+    {
+        return linktype == 101 ? DLT_RAW : int(linktype);
+    }
+
+    uint16_t rd16(const uint8_t* p) const
+    {
+        uint16_t v;
+        memcpy(&v, p, 2);
+        return swap_ ? __builtin_bswap16(v) : v;
+    }
+
+    uint32_t rd32(const uint8_t* p) const
+    {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return swap_ ? __builtin_bswap32(v) : v;
+    }
+
+    // make 'n' bytes available from p_; false if the file ends first
+    bool need(size_t n)
+    {
+        if (size_t(end_ - p_) >= n) {
+            return true;
+        }
+        if (comp_ == COMP_NONE) {
+            return false;
+        }
+        // move what's left to the front and decompress more after it
+        size_t left = end_ - p_;
+        if (left > 0 && p_ != buf_.data()) {
+            memmove(&buf_[0], p_, left);
+        }
+        if (buf_.size() < n + CAPFILE_INBUF * 4) {
+            buf_.resize(n + CAPFILE_INBUF * 4);
+        }
+        size_t have = left;
+        while (have < n) {
+            size_t got = inflateSome(&buf_[have], buf_.size() - have);
+            if (got == 0) {
+                break;
+            }
+            have += got;
+        }
+        p_ = buf_.data();
+        end_ = p_ + have;
+        return have >= n;
+    }
+
+    // decompress up to 'len' bytes into 'out'; 0 at the end
+    size_t inflateSome(uint8_t* out, size_t len)
+    {
+        for (;;) {
+            if (inPos_ == inLen_ && !inEof_) {
+                ssize_t r = read(fd_, &in_[0], in_.size());
+                if (r <= 0) {
+                    inEof_ = true;
+                } else {
+                    inPos_ = 0;
+                    inLen_ = r;
+                }
+            }
+            if (inPos_ == inLen_) {
+                return 0;
+            }
+            size_t got;
+            if (comp_ == COMP_GZIP) {
+                zs_.next_in = &in_[inPos_];
+                zs_.avail_in = uInt(inLen_ - inPos_);
+                zs_.next_out = out;
+                zs_.avail_out = uInt(len);
+                int r = inflate(&zs_, Z_NO_FLUSH);
+                inPos_ = inLen_ - zs_.avail_in;
+                got = len - zs_.avail_out;
+                if (r == Z_STREAM_END) {
+                    inflateReset(&zs_);     // (there may be another member)
+                } else if (r != Z_OK && r != Z_BUF_ERROR) {
+                    err_ = name_ + ": gzip: " + (zs_.msg ? zs_.msg : "bad data");
+                    inPos_ = inLen_;
+                    inEof_ = true;
+                    return got;
+                }
+            } else {
+#ifdef PPING_WITH_ZSTD
+                ZSTD_inBuffer ib = {&in_[0], inLen_, inPos_};
+                ZSTD_outBuffer ob = {out, len, 0};
+                size_t r = ZSTD_decompressStream(zd_, &ob, &ib);
+                inPos_ = ib.pos;
+                got = ob.pos;
+                if (ZSTD_isError(r)) {
+                    err_ = name_ + ": zstd: " + ZSTD_getErrorName(r);
+                    inPos_ = inLen_;
+                    inEof_ = true;
+                    return got;
+                }
+#else
+                return 0;
+#endif
+            }
+            if (got > 0) {
+                return got;
+            }
+        }
+    }
+
+    void advance(size_t n)
+    {
+        p_ += n;
+        if (map_ && p_ >= nxtHint_) {
+            // ask for the next window ahead of time
+            size_t off = (nxtHint_ - map_) & ~size_t(4095);
+            if (off < mapLen_) {
+                madvise(const_cast<uint8_t*>(map_) + off,
+                        std::min<size_t>(CAPFILE_AHEAD, mapLen_ - off),
+                        MADV_WILLNEED);
+            }
+            nxtHint_ += CAPFILE_AHEAD;
+        }
+    }
+
+    void readHeader()
+    {
+        if (!need(24)) {
+            fail("too short to be a capture file");
+        }
+        uint32_t m;
+        memcpy(&m, p_, 4);
+        if (m == 0x0a0d0d0a) {
+            ng_ = true;     // the section header block is read by nextNg()
+            return;
+        }
+        if (m == 0xa1b2c3d4 || m == 0xa1b23c4d) {
+            swap_ = false;
+        } else if (m == 0xd4c3b2a1 || m == 0x4d3cb2a1) {
+            swap_ = true;
+        } else {
+            fail("not a pcap or pcapng file");
+        }
+        bool nano = (rd32(p_) == 0xa1b23c4d);
+        ifs_.push_back(iface{toDlt(rd32(p_ + 20) & 0xffff),
+                             nano ? 1000000000u : 1000000u});
+        advance(24);
+    }
+
+    bool nextPcap(capFrame& f)
+    {
+        if (!need(16)) {
+            return false;
+        }
+        uint32_t caplen = rd32(p_ + 8);
+        if (caplen > (1u << 26)) {
+            err_ = name_ + ": bad record length";
+            return false;
+        }
+        if (!need(16 + caplen)) {
+            return false;
+        }
+        f.sec = rd32(p_);
+        uint32_t frac = rd32(p_ + 4);
+        f.nsec = (ifs_[0].tsDiv == 1000000) ? int64_t(frac) * 1000 : frac;
+        f.caplen = caplen;
+        f.wireLen = rd32(p_ + 12);
+        f.dlt = ifs_[0].dlt;
+        f.data = p_ + 16;
+        advance(16 + caplen);
+        return true;
+    }
+
+    bool nextNg(capFrame& f)
+    {
+        for (;;) {
+            if (!need(12)) {
+                return false;
+            }
+            uint32_t type;
+            memcpy(&type, p_, 4);
+            if (type == 0x0a0d0d0a) {
+                // section header: sets the byte order of what follows
+                uint32_t bom;
+                memcpy(&bom, p_ + 8, 4);
+                if (bom == 0x1a2b3c4d) {
+                    swap_ = false;
+                } else if (bom == 0x4d3c2b1a) {
+                    swap_ = true;
+                } else {
+                    err_ = name_ + ": bad pcapng section header";
+                    return false;
+                }
+                ifs_.clear();
+            } else {
+                type = rd32(p_);
+            }
+            uint32_t len = rd32(p_ + 4);
+            if (len < 12 || len > (1u << 26) || (len & 3) != 0) {
+                err_ = name_ + ": bad pcapng block length";
+                return false;
+            }
+            if (!need(len)) {
+                return false;
+            }
+            const uint8_t* b = p_ + 8;      // block body
+            size_t bodyLen = len - 12;
+            if (type == 1 && bodyLen >= 8) {
+                ifs_.push_back(iface{toDlt(rd16(b)), tsResol(b + 8, bodyLen - 8)});
+            } else if ((type == 6 || type == 2) && bodyLen >= 20) {
+                // enhanced (6) or obsolete (2) packet block
+                uint32_t ifc = (type == 6) ? rd32(b) : rd16(b);
+                uint32_t caplen = rd32(b + 12);
+                if (ifc < ifs_.size() && caplen <= bodyLen - 20) {
+                    uint64_t ts = (uint64_t(rd32(b + 4)) << 32) | rd32(b + 8);
+                    uint64_t div = ifs_[ifc].tsDiv;
+                    f.sec = int64_t(ts / div);
+                    f.nsec = int64_t((unsigned __int128)(ts % div) *
+                                     1000000000 / div);
+                    f.caplen = caplen;
+                    f.wireLen = rd32(b + 16);
+                    f.dlt = ifs_[ifc].dlt;
+                    f.data = b + 20;
+                    advance(len);
+                    return true;
+                }
+            }
+            advance(len);
+        }
+    }
+
+    // timestamp units per second from an interface's if_tsresol option
+    uint64_t tsResol(const uint8_t* o, size_t len) const
+    {
+        while (len >= 4) {
+            uint16_t code = rd16(o), olen = rd16(o + 2);
+            if (code == 0 || size_t(4 + olen) > len) {
+                break;
+            }
+            if (code == 9 && olen >= 1) {
+                uint8_t r = o[4];
+                uint64_t div = 1;
+                for (int i = 0; i < (r & 0x7f) && div < (1ull << 60) / 10; i++) {
+                    div *= (r & 0x80) ? 2 : 10;
+                }
+                return div;
+            }
+            size_t step = 4 + ((olen + 3) & ~3);
+            o += step;
+            len -= std::min(step, len);
+        }
+        return 1000000;
+    }
+
+    std::string name_;
+    std::string err_;
+    int fd_{-1};
+    compression comp_{COMP_NONE};
+    bool ng_{false};
+    bool swap_{false};
+    std::vector<iface> ifs_;
+
+    const uint8_t* p_{};        // next unread byte
+    const uint8_t* end_{};
+
+    // uncompressed
+    const uint8_t* map_{};
+    size_t mapLen_{};
+    const uint8_t* nxtHint_{};
+
+    // compressed
+    z_stream zs_{};
+#ifdef PPING_WITH_ZSTD
+    ZSTD_DCtx* zd_{};
+#endif
+    std::vector<uint8_t> in_;
+    size_t inPos_{};
+    size_t inLen_{};
+    bool inEof_{false};
+    std::vector<uint8_t> buf_;
+};
+
+// A pcap filter expression, compiled per link type as frames of each
+// turn up
+class capFilter
+{
+  public:
+    explicit capFilter(const std::string& expr) : expr_{expr} {}
+
+    ~capFilter()
+    {
+        for (auto& kv : progs_) {
+            pcap_freecode(&kv.second);
+        }
+    }
+
+    capFilter(const capFilter&) = delete;
+    capFilter& operator=(const capFilter&) = delete;
+
+    // throws std::runtime_error if the expression doesn't compile for
+    // link type 'dlt'
+    void prepare(int dlt) { prog(dlt); }
+
+    // whether the expression compiles for link type 'dlt' (match() may
+    // then be called for its frames); a failure is remembered, and its
+    // message is left in error()
+    bool compiles(int dlt)
+    {
+        if (progs_.count(dlt) != 0) {
+            return true;
+        }
+        if (bad_.count(dlt) != 0) {
+            return false;
+        }
+        try {
+            prog(dlt);
+            return true;
+        } catch (std::runtime_error& ex) {
+            bad_.insert(dlt);
+            const char* name = pcap_datalink_val_to_name(dlt);
+            err_ = std::string(name ? name : "link type " + std::to_string(dlt)) +
+                   " frames skipped: " + ex.what();
+            return false;
+        }
+    }
+
+    const std::string& error() const { return err_; }
+
+    bool match(const capFrame& f)
+    {
+        struct pcap_pkthdr h;
+        h.ts.tv_sec = f.sec;
+        h.ts.tv_usec = f.nsec / 1000;
+        h.caplen = f.caplen;
+        h.len = f.wireLen;
+        return pcap_offline_filter(&prog(f.dlt), &h, f.data) != 0;
+    }
+
+  private:
+    struct bpf_program& prog(int dlt)
+    {
+        auto it = progs_.find(dlt);
+        if (it != progs_.end()) {
+            return it->second;
+        }
+        struct bpf_program p;
+        pcap_t* pd = pcap_open_dead(dlt, 262144);
+        if (pcap_compile(pd, &p, expr_.c_str(), 1, PCAP_NETMASK_UNKNOWN) < 0) {
+            std::string e = std::string("filter: ") + pcap_geterr(pd);
+            pcap_close(pd);
+            throw std::runtime_error(e);
+        }
+        pcap_close(pd);
+        return progs_[dlt] = p;
+    }
+
+    std::string expr_;
+    std::map<int, struct bpf_program> progs_;
+    std::set<int> bad_;     // link types it doesn't compile for
+    std::string err_;
+};
+
+#endif
@@ -0,0 +1,171 @@
+/**********************************************************************
+ flowsnap.h - flow table snapshots for pping-exporter's warm restarts
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ A snapshot holds the exporter's bi-directional flows: their keys, min
+ RTTs, byte counts and when they were last seen. It's written every so
+ often and at exit and loaded at startup, so the min RTTs and the
+ pairing of flows with their reverses survive a restart rather than
+ having to be relearnt from traffic. TSvals aren't kept: they're only
+ good for tsvalMaxAge anyway.
+
+ The file is a flowSnapHeader followed by fixed-size flowSnapRecs, in
+ host byte order, so loading it is just mapping it. It's written to a
+ temporary file that's then renamed over the old one, so a crash never
+ leaves a partly written snapshot behind.
+
+  ***********************************************************************/
+
+#ifndef PPING_FLOWSNAP_H
+#define PPING_FLOWSNAP_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct flowSnapHeader
+{
+    char magic[8];          // "PPFLOWS"
+    uint32_t version;       // 1
+    uint32_t recordSize;    // sizeof(flowSnapRec)
+    uint64_t count;         // records that follow
+    int64_t writtenNs;      // when, ns since the epoch
+};
+
+#define FLOWSNAP_MAGIC "PPFLOWS"
+
+struct flowSnapRec
+{
+    uint8_t src[16];        // IPv4 as ::ffff:a.b.c.d
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t reserved;
+    int64_t lastNs;         // last packet, ns since the epoch
+    double min;             // min RTT (s)
+    double bytesSnt;
+    double lstBytesSnt;
+    double bytesDep;
+};
+
+// Write 'n' records at 'recs' to snapshot file 'path', taken at
+// 'writtenNs'; throws std::runtime_error
+static inline void writeFlowSnapshot(const std::string& path,
+                                     const flowSnapRec* recs, size_t n,
+                                     int64_t writtenNs)
+{
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error(tmp + ": " + strerror(errno));
+    }
+    flowSnapHeader h{};
+    memcpy(h.magic, FLOWSNAP_MAGIC, sizeof(FLOWSNAP_MAGIC));
+    h.version = 1;
+    h.recordSize = sizeof(flowSnapRec);
+    h.count = n;
+    h.writtenNs = writtenNs;
+
+    const char* parts[2] = {reinterpret_cast<const char*>(&h),
+                            reinterpret_cast<const char*>(recs)};
+    size_t lens[2] = {sizeof(h), n * sizeof(flowSnapRec)};
+    for (int i = 0; i < 2; i++) {
+        for (size_t off = 0; off < lens[i]; ) {
+            ssize_t r = write(fd, parts[i] + off, lens[i] - off);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                std::string err = tmp + ": " + strerror(errno);
+                close(fd);
+                unlink(tmp.c_str());
+                throw std::runtime_error(err);
+            }
+            off += size_t(r);
+        }
+    }
+    if (close(fd) < 0 || rename(tmp.c_str(), path.c_str()) < 0) {
+        std::string err = path + ": " + strerror(errno);
+        unlink(tmp.c_str());
+        throw std::runtime_error(err);
+    }
+}
+
+// A snapshot file, mapped read-only
+class flowSnapshot
+{
+  public:
+    // throws std::runtime_error if 'path' can't be read or isn't a
+    // snapshot (of this version)
+    explicit flowSnapshot(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error(path + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            std::string err = path + ": " + strerror(errno);
+            close(fd);
+            throw std::runtime_error(err);
+        }
+        len_ = size_t(st.st_size);
+        if (len_ >= sizeof(flowSnapHeader)) {
+            void* m = mmap(nullptr, len_, PROT_READ, MAP_PRIVATE, fd, 0);
+            map_ = (m == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(m);
+        }
+        close(fd);
+        const flowSnapHeader* h = header();
+        if (h == nullptr || memcmp(h->magic, FLOWSNAP_MAGIC,
+                                   sizeof(FLOWSNAP_MAGIC)) != 0 ||
+            h->version != 1 || h->recordSize != sizeof(flowSnapRec) ||
+            h->count > (len_ - sizeof(*h)) / sizeof(flowSnapRec)) {
+            release();
+            throw std::runtime_error(path + ": not a flow snapshot");
+        }
+    }
+
+    ~flowSnapshot() { release(); }
+    flowSnapshot(const flowSnapshot&) = delete;
+    flowSnapshot& operator=(const flowSnapshot&) = delete;
+
+    size_t size() const { return header()->count; }
+    int64_t writtenNs() const { return header()->writtenNs; }
+    const flowSnapRec* records() const
+    {
+        return reinterpret_cast<const flowSnapRec*>(map_ + sizeof(flowSnapHeader));
+    }
+
+  private:
+    const flowSnapHeader* header() const
+    {
+        return reinterpret_cast<const flowSnapHeader*>(map_);
+    }
+
+    void release()
+    {
+        if (map_) {
+            munmap(map_, len_);
+            map_ = nullptr;
+        }
+    }
+
+    uint8_t* map_{};
+    size_t len_{};
+};
+
+#endif
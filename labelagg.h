@@ -0,0 +1,231 @@
+/**********************************************************************
+ labelagg.h - srcIP label aggregation for pping-exporter's RTT series
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ Bounds the number of pping_service_rtt series when there are many
+ sources. A flow's srcIP label value can be:
+  - the name of the first --srcGroup CIDR containing the source,
+  - else its --srcPrefix network ("10.1.2.0/24"), else the address,
+  - and, with --topSrc K, "other" unless that value is one of the K
+    with the most samples.
+ The label is worked out once per flow and kept with its series handle;
+ only a change of the top-K set (at most once a second) makes flows
+ check theirs again.
+
+ The top-K sources are tracked with the Space-Saving algorithm in a
+ table of TOPK_TRACK * K entries, so memory doesn't grow with the
+ number of sources. The entries are a min-heap on count, so the one a
+ new source takes over is the root and counting a sample is O(log K),
+ even for a flood of new sources.
+
+  ***********************************************************************/
+
+#ifndef PPING_LABELAGG_H
+#define PPING_LABELAGG_H
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "lpm.h"
+
+#define TOPK_TRACK 8        // Space-Saving table size, in multiples of K
+
+class labelRules
+{
+  public:
+    // 'cidr' is an IPv4 or IPv6 prefix; throws std::invalid_argument
+    void addGroup(const std::string& name, const std::string& cidr)
+    {
+        group g;
+        g.name = name;
+        if (!parseCidr(cidr, g.addr, g.len)) {
+            throw std::invalid_argument(cidr + " is not valid CIDR notation");
+        }
+        groups_.push_back(g);
+    }
+
+    // prefix lengths sources are truncated to (0 = keep the address)
+    void setPrefix(int v4Len, int v6Len)
+    {
+        v4Len_ = std::min(std::max(v4Len, 0), 32);
+        v6Len_ = std::min(std::max(v6Len, 0), 128);
+    }
+
+    void setTopK(size_t k) { k_ = k; }
+    bool ranked() const { return k_ > 0; }
+
+    // srcIP label value of address 'a' (16 bytes, IPv4 v4-mapped),
+    // before top-K
+    std::string srcLabel(const uint8_t* a, bool v4) const
+    {
+        for (const auto& g : groups_) {
+            if (matches(a, g.addr, g.len)) {
+                return g.name;
+            }
+        }
+        int len = v4 ? v4Len_ : v6Len_;
+        char buf[INET6_ADDRSTRLEN + 4];
+        if (len == 0) {
+            inet_ntop(v4 ? AF_INET : AF_INET6, v4 ? a + 12 : a, buf, sizeof(buf));
+            return buf;
+        }
+        uint8_t net[16];
+        int bits = v4 ? 96 + len : len;
+        for (int i = 0; i < 16; i++) {
+            int keep = std::min(std::max(bits - i * 8, 0), 8);
+            net[i] = a[i] & uint8_t(0xff00 >> keep);
+        }
+        inet_ntop(v4 ? AF_INET : AF_INET6, v4 ? net + 12 : net, buf, sizeof(buf));
+        return std::string(buf) + "/" + std::to_string(len);
+    }
+
+    // value to put in the label for source label value 'src'
+    std::string topOrOther(const std::string& src)
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return top_.count(src) ? src : "other";
+    }
+
+    // add n samples to source 'src'
+    void count(const std::string& src, uint64_t n)
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        auto it = pos_.find(src);
+        if (it != pos_.end()) {
+            heap_[it->second].count += n;
+            siftDown(it->second);
+        } else if (heap_.size() < k_ * TOPK_TRACK) {
+            auto r = pos_.emplace(src, heap_.size());
+            heap_.push_back(ssEntry{n, &*r.first});
+            siftUp(heap_.size() - 1);
+        } else {
+            // Space-Saving: the new source takes over the smallest entry,
+            // the heap's root (and its count, which bounds how far it's
+            // overestimated)
+            pos_.erase(heap_[0].src->first);
+            heap_[0].src = &*pos_.emplace(src, 0).first;
+            heap_[0].count += n;
+            siftDown(0);
+        }
+
+        // recompute the top K, at most once a second once it's full
+        auto now = std::chrono::steady_clock::now();
+        if (top_.size() >= k_ && now < nxtRank_) {
+            return;
+        }
+        nxtRank_ = now + std::chrono::seconds(1);
+        std::vector<std::pair<uint64_t, const std::string*>> v;
+        v.reserve(heap_.size());
+        for (const auto& e : heap_) {
+            v.emplace_back(e.count, &e.src->first);
+        }
+        size_t k = std::min(k_, v.size());
+        std::nth_element(v.begin(), v.begin() + k, v.end(),
+            [](const std::pair<uint64_t, const std::string*>& x,
+               const std::pair<uint64_t, const std::string*>& y) {
+                return x.first > y.first;
+            });
+        std::unordered_set<std::string> top;
+        for (size_t i = 0; i < k; i++) {
+            top.insert(*v[i].second);
+        }
+        if (top != top_) {
+            top_.swap(top);
+            gen_.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    // changes whenever the top-K set does
+    uint32_t generation() const { return gen_.load(std::memory_order_acquire); }
+
+  private:
+    struct group
+    {
+        std::string name;
+        uint8_t addr[16];
+        int len;        // in bits of the (v4-mapped) 128 bit address
+    };
+
+    // a Space-Saving entry; 'src' is its node in pos_ (whose value is the
+    // entry's index in heap_)
+    struct ssEntry
+    {
+        uint64_t count;
+        std::pair<const std::string, size_t>* src;
+    };
+
+    void swapEntries(size_t i, size_t j)
+    {
+        std::swap(heap_[i], heap_[j]);
+        heap_[i].src->second = i;
+        heap_[j].src->second = j;
+    }
+
+    void siftUp(size_t i)
+    {
+        while (i > 0 && heap_[(i - 1) / 2].count > heap_[i].count) {
+            swapEntries(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void siftDown(size_t i)
+    {
+        for (;;) {
+            size_t m = i;
+            for (size_t c = 2 * i + 1; c <= 2 * i + 2 && c < heap_.size(); c++) {
+                if (heap_[c].count < heap_[m].count) {
+                    m = c;
+                }
+            }
+            if (m == i) {
+                return;
+            }
+            swapEntries(i, m);
+            i = m;
+        }
+    }
+
+    static bool matches(const uint8_t* a, const uint8_t* net, int len)
+    {
+        int full = len / 8;
+        if (memcmp(a, net, full) != 0) {
+            return false;
+        }
+        int rest = len % 8;
+        return rest == 0 || ((a[full] ^ net[full]) & uint8_t(0xff00 >> rest)) == 0;
+    }
+
+    std::vector<group> groups_;
+    int v4Len_{};
+    int v6Len_{};
+
+    size_t k_{};
+    std::mutex mtx_;
+    std::vector<ssEntry> heap_;     // min-heap on count
+    std::unordered_map<std::string, size_t> pos_;   // (node pointers stay
+                                                    // valid across rehashes)
+    std::unordered_set<std::string> top_;
+    std::chrono::steady_clock::time_point nxtRank_;
+    std::atomic<uint32_t> gen_{0};
+};
+
+#endif
@@ -0,0 +1,164 @@
+/**********************************************************************
+ lpm.h - IPv4/IPv6 prefix sets for pping-exporter's local address filter
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ A prefixSet answers "is this address in any of the prefixes" for the
+ -L ranges and the interface's own addresses, on every packet. The
+ prefixes are compiled into a multibit trie with a stride of 8 bits
+ (controlled prefix expansion), one for IPv4 and one for IPv6, so a
+ lookup is at most 4 (IPv4) or 16 (IPv6) array reads on the raw
+ address bytes no matter how many prefixes there are.
+
+ Since only membership matters, a prefix covering a part of the trie
+ simply replaces it.
+
+  ***********************************************************************/
+
+#ifndef PPING_LPM_H
+#define PPING_LPM_H
+
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Parse "a.b.c.d[/n]" or "v6addr[/n]" into a 16 byte address (IPv4 ones
+// v4-mapped) and a prefix length in bits of that 128 bit address
+static inline bool parseCidr(const std::string& cidr, uint8_t* addr, int& len)
+{
+    auto slash = cidr.find('/');
+    std::string ip = cidr.substr(0, slash);
+    int max;
+    memset(addr, 0, 16);
+    if (inet_pton(AF_INET, ip.c_str(), addr + 12) == 1) {
+        addr[10] = addr[11] = 0xff;
+        max = 32;
+    } else if (inet_pton(AF_INET6, ip.c_str(), addr) == 1) {
+        max = 128;
+    } else {
+        return false;
+    }
+    len = max;
+    if (slash != std::string::npos) {
+        char* end;
+        len = strtol(cidr.c_str() + slash + 1, &end, 10);
+        if (*end != '\0' || end == cidr.c_str() + slash + 1 ||
+            len < 0 || len > max) {
+            return false;
+        }
+    }
+    len += 128 - max;
+    return true;
+}
+
+class prefixSet
+{
+  public:
+    struct prefix
+    {
+        uint8_t addr[16];   // IPv4 v4-mapped
+        int len;            // of the 128 bit address
+        bool v4;
+        int hostLen() const { return v4 ? len - 96 : len; }  // 0-32 / 0-128
+    };
+
+    prefixSet()
+    {
+        nodes_.resize(2);   // the IPv4 and IPv6 roots
+    }
+
+    // 'cidr' as for parseCidr(); throws std::invalid_argument
+    void add(const std::string& cidr)
+    {
+        uint8_t a[16];
+        int len;
+        if (!parseCidr(cidr, a, len)) {
+            throw std::invalid_argument(cidr + " is not valid CIDR notation");
+        }
+        add(a, len);
+    }
+
+    // 16 byte address 'a' (IPv4 v4-mapped) with 'len' bits of prefix
+    void add(const uint8_t* a, int len)
+    {
+        prefix p;
+        memcpy(p.addr, a, 16);
+        p.len = len;
+        p.v4 = isV4(a) && len >= 96;
+        prefixes_.push_back(p);
+
+        const uint8_t* b = p.v4 ? a + 12 : a;
+        int bits = p.hostLen();
+        int32_t n = p.v4 ? V4_ROOT : V6_ROOT;
+        int i = 0;
+        for (; bits - 8 * i > 8; i++) {
+            int32_t& e = nodes_[n].e[b[i]];
+            if (e == COVERED) {
+                return;
+            }
+            if (e == EMPTY) {
+                e = int32_t(nodes_.size());
+                nodes_.emplace_back(); // (invalidates 'e')
+            }
+            n = nodes_[n].e[b[i]];
+        }
+        // the remaining 0-8 bits: expand over the entries they cover
+        int rest = bits - 8 * i;
+        int first = b[i] & (0xff00 >> rest);
+        for (int j = first; j < first + (256 >> rest); j++) {
+            nodes_[n].e[j] = COVERED;
+        }
+    }
+
+    bool empty() const { return prefixes_.empty(); }
+    const std::vector<prefix>& prefixes() const { return prefixes_; }
+
+    // is 16 byte address 'a' (IPv4 v4-mapped, 'v4' set) in the set
+    bool contains(const uint8_t* a, bool v4) const
+    {
+        const uint8_t* b = v4 ? a + 12 : a;
+        int len = v4 ? 4 : 16;
+        int32_t n = v4 ? V4_ROOT : V6_ROOT;
+        for (int i = 0; i < len; i++) {
+            int32_t e = nodes_[n].e[b[i]];
+            if (e <= 0) {
+                return e == COVERED;
+            }
+            n = e;
+        }
+        return false;
+    }
+
+    static bool isV4(const uint8_t* a)
+    {
+        static const uint8_t v4pfx[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+        return memcmp(a, v4pfx, sizeof(v4pfx)) == 0;
+    }
+
+  private:
+    // node entries: EMPTY, COVERED or the index of a child node (roots
+    // are never children so child indexes are > 1)
+    static constexpr int32_t EMPTY = 0;
+    static constexpr int32_t COVERED = -1;
+    static constexpr int32_t V4_ROOT = 0;
+    static constexpr int32_t V6_ROOT = 1;
+
+    struct node
+    {
+        int32_t e[256] {};
+    };
+
+    std::vector<node> nodes_;
+    std::vector<prefix> prefixes_;
+};
+
+#endif
@@ -0,0 +1,235 @@
+/**********************************************************************
+ output.h - batched RTT sample output for pping-exporter
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ Samples are handed, as fixed-size sampleRecords, to a writer thread
+ through one SPSC queue per producer (flow table worker). The writer
+ formats them into a set of large buffers and writes those out with a
+ single writev() when they fill up or every flush interval, so the
+ workers never format or do I/O, and there is no stdio buffer shared
+ between threads.
+
+ The formatting is pluggable (a function per output format). The binary
+ format is just the sampleRecords themselves after a sampleFileHeader,
+ in host byte order.
+
+  ***********************************************************************/
+
+#ifndef PPING_OUTPUT_H
+#define PPING_OUTPUT_H
+
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "spscring.h"
+
+// One RTT sample, and the record of the binary output format
+struct sampleRecord
+{
+    uint8_t src[16];    // IP addresses, IPv4 ones v4-mapped (::ffff:a.b.c.d)
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t reserved;
+    int64_t tsNs;       // capture time, ns since the epoch
+    int64_t rttNs;
+    int64_t minNs;      // flow's min RTT so far
+    uint64_t fBytes;    // see ppWorker::process()
+    uint64_t dBytes;
+    uint64_t pBytes;
+};
+static_assert(sizeof(sampleRecord) == 88, "sampleRecord layout changed");
+
+// start of a binary output stream
+struct sampleFileHeader
+{
+    char magic[6];          // "PPSAMP"
+    uint16_t version;       // 1
+    uint32_t recordSize;    // sizeof(sampleRecord)
+    uint32_t reserved;
+};
+
+#define SAMPLE_MAGIC "PPSAMP"
+#define MAX_SAMPLE_LEN 256  // longest formatted sample
+
+// Formats a sample into 'out' (which has room for MAX_SAMPLE_LEN bytes)
+// and returns its length
+typedef size_t (*sampleFormatter)(const sampleRecord& r, char* out);
+
+class sampleWriter
+{
+  public:
+    sampleWriter(int fd, sampleFormatter fmt, size_t nProducers, int64_t flushUs)
+        : fd_{fd}, fmt_{fmt}, flushUs_{flushUs}
+    {
+        for (size_t i = 0; i < nProducers; i++) {
+            queues_.emplace_back(new spscRing<sampleRecord>(1 << 14));
+        }
+        for (auto& c : chunks_) {
+            c.reset(new char[CHUNK]);
+        }
+    }
+    ~sampleWriter() { stop(); }
+    sampleWriter(const sampleWriter&) = delete;
+    sampleWriter& operator=(const sampleWriter&) = delete;
+
+    // bytes to go out ahead of the samples (e.g. a header)
+    void preamble(const void* p, size_t len)
+    {
+        const char* c = static_cast<const char*>(p);
+        std::copy(c, c + len, std::back_inserter(preamble_));
+    }
+
+    void start() { thread_ = std::thread(&sampleWriter::run, this); }
+
+    // hand a sample to the writer; only called by producer 'q'. Waits if
+    // the writer is behind rather than lose the sample.
+    void write(size_t q, const sampleRecord& r)
+    {
+        while (!queues_[q]->push(r)) {
+            std::this_thread::yield();
+        }
+    }
+
+    // write out everything queued so far and stop the writer thread
+    void stop()
+    {
+        if (thread_.joinable()) {
+            done_.store(true, std::memory_order_release);
+            thread_.join();
+        }
+    }
+
+  private:
+    static constexpr size_t CHUNK = 64 * 1024;
+    static constexpr size_t NCHUNKS = 16;
+
+    void run()
+    {
+        if (!preamble_.empty()) {
+            writeAll(preamble_.data(), preamble_.size());
+        }
+        sampleRecord batch[256];
+        auto lastFlush = std::chrono::steady_clock::now();
+        for (;;) {
+            // everything was queued before done_ was set so once it's
+            // seen, empty queues mean there's nothing more to come
+            bool done = done_.load(std::memory_order_acquire);
+            size_t got = 0;
+            for (auto& q : queues_) {
+                size_t n = q->pop(batch, 256);
+                for (size_t i = 0; i < n; i++) {
+                    append(batch[i]);
+                }
+                got += n;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (used() > 0 && (done || now - lastFlush >=
+                               std::chrono::microseconds(flushUs_))) {
+                flush();
+                lastFlush = now;
+            }
+            if (got == 0) {
+                if (done) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    size_t used() const { return cur_ * CHUNK + len_[cur_]; }
+
+    void append(const sampleRecord& r)
+    {
+        if (CHUNK - len_[cur_] < MAX_SAMPLE_LEN) {
+            if (cur_ + 1 == NCHUNKS) {
+                flush();
+            } else {
+                cur_++;
+            }
+        }
+        len_[cur_] += fmt_(r, chunks_[cur_].get() + len_[cur_]);
+    }
+
+    // write all filled chunks with one writev
+    void flush()
+    {
+        struct iovec iov[NCHUNKS];
+        int n = 0;
+        for (size_t i = 0; i <= cur_; i++) {
+            if (len_[i] > 0) {
+                iov[n].iov_base = chunks_[i].get();
+                iov[n].iov_len = len_[i];
+                n++;
+            }
+        }
+        struct iovec* v = iov;
+        while (n > 0) {
+            ssize_t w = writev(fd_, v, n);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;      // (output closed; nothing useful to do)
+            }
+            while (n > 0 && size_t(w) >= v->iov_len) {
+                w -= v->iov_len;
+                v++;
+                n--;
+            }
+            if (n > 0) {
+                v->iov_base = static_cast<char*>(v->iov_base) + w;
+                v->iov_len -= w;
+            }
+        }
+        for (size_t i = 0; i <= cur_; i++) {
+            len_[i] = 0;
+        }
+        cur_ = 0;
+    }
+
+    void writeAll(const char* p, size_t len)
+    {
+        while (len > 0) {
+            ssize_t w = ::write(fd_, p, len);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                return;
+            }
+            p += w;
+            len -= w;
+        }
+    }
+
+    int fd_;
+    sampleFormatter fmt_;
+    int64_t flushUs_;
+    std::vector<std::unique_ptr<spscRing<sampleRecord>>> queues_;
+    std::vector<char> preamble_;
+    std::unique_ptr<char[]> chunks_[NCHUNKS];
+    size_t len_[NCHUNKS] {};
+    size_t cur_{};
+    std::atomic<bool> done_{false};
+    std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,320 @@
+/**********************************************************************
+ pcapmerge.h - time-ordered reading of many capture files
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ pcapMerge reads a set of capture files (e.g. a day of rotated captures,
+ or captures of several interfaces) as if they were one: their frames
+ are handed out in timestamp order by a k-way merge.
+
+ Files are read (with capFile, so they may be pcap or pcapng, and
+ compressed) and filtered by reader threads, PCAPMERGE_PREFETCH files
+ ahead of the merge, each into a short queue of chunks of frames, so the
+ merge (the capture thread) never waits on the disk. A file only joins
+ the merge once the merge's time has reached its first frame, so files
+ that don't overlap in time are simply read one after another and only
+ overlapping ones are merged. Equal timestamps are taken in order of the
+ files' first frames (then names), so a run is repeatable and gives the
+ same result as a single file holding the same frames.
+
+  ***********************************************************************/
+
+#ifndef PPING_PCAPMERGE_H
+#define PPING_PCAPMERGE_H
+
+#include <dirent.h>
+#include <glob.h>
+#include <pcap.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "capfile.h"
+#include "spscring.h"
+#include "tcpparse.h"
+
+#define PCAPMERGE_PREFETCH 4        // files read ahead of the merge
+#define PCAPMERGE_CHUNK (256 * 1024)  // frame bytes per chunk
+#define PCAPMERGE_QUEUE 8           // chunks queued per file (power of 2)
+
+// A frame handed out by pcapMerge::run(); only valid during the call
+struct mergedFrame
+{
+    const uint8_t* data;
+    uint32_t caplen;
+    int dlt;
+    int64_t sec;
+    int64_t nsec;
+};
+
+class pcapMerge
+{
+  public:
+    // Append the files named by 'spec' to 'out': the file itself, the
+    // files in it if it's a directory, or what it matches if it's a
+    // glob pattern (both sorted by name). Throws std::runtime_error if
+    // that's nothing.
+    static void expand(const std::string& spec, std::vector<std::string>& out)
+    {
+        struct stat st;
+        std::vector<std::string> v;
+        if (stat(spec.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (DIR* d = opendir(spec.c_str())) {
+                while (struct dirent* e = readdir(d)) {
+                    std::string p = spec + "/" + e->d_name;
+                    if (e->d_name[0] != '.' && stat(p.c_str(), &st) == 0 &&
+                        S_ISREG(st.st_mode)) {
+                        v.push_back(p);
+                    }
+                }
+                closedir(d);
+            }
+        } else if (spec.find_first_of("*?[") != std::string::npos) {
+            glob_t g;
+            if (glob(spec.c_str(), 0, nullptr, &g) == 0) {
+                for (size_t i = 0; i < g.gl_pathc; i++) {
+                    v.push_back(g.gl_pathv[i]);
+                }
+            }
+            globfree(&g);
+        } else {
+            v.push_back(spec);
+        }
+        if (v.empty()) {
+            throw std::runtime_error("no capture files in " + spec);
+        }
+        std::sort(v.begin(), v.end());
+        out.insert(out.end(), v.begin(), v.end());
+    }
+
+    // Open 'files' (to get their link types and first timestamps) with
+    // pcap filter 'filter'; throws std::runtime_error
+    pcapMerge(const std::vector<std::string>& files, const std::string& filter)
+        : filter_{filter}
+    {
+        capFilter filt(filter_);
+        for (const auto& f : files) {
+            std::unique_ptr<source> s(new source);
+            s->name = f;
+            capFile cf(f);
+            s->dlt = cf.dlt();
+            if (rawParseDlt(s->dlt)) {
+                filt.prepare(s->dlt);
+            }
+            capFrame fr;
+            while (cf.next(fr)) {
+                // (frames the raw parser can't take are left to be
+                // counted as they're merged; they aren't filtered)
+                if (rawParseDlt(fr.dlt) && filt.compiles(fr.dlt) &&
+                    filt.match(fr)) {
+                    s->first = fr.sec * 1000000000 + fr.nsec;
+                    break;
+                }
+            }
+            srcs_.push_back(std::move(s));
+        }
+        std::stable_sort(srcs_.begin(), srcs_.end(),
+                         [](const std::unique_ptr<source>& a,
+                            const std::unique_ptr<source>& b) {
+                             return a->first < b->first;
+                         });
+    }
+
+    ~pcapMerge()
+    {
+        stop_ = true;
+        for (auto& s : srcs_) {
+            if (s->reader.joinable()) {
+                s->reader.join();
+            }
+            chunk* c;
+            while (s->queue.pop(&c, 1) == 1) {
+                delete c;
+            }
+        }
+    }
+
+    pcapMerge(const pcapMerge&) = delete;
+    pcapMerge& operator=(const pcapMerge&) = delete;
+
+    // link types of the files (of their first interfaces)
+    std::vector<int> dlts() const
+    {
+        std::vector<int> v;
+        for (const auto& s : srcs_) {
+            v.push_back(s->dlt);
+        }
+        return v;
+    }
+
+    // Hand every frame, in timestamp order, to fn(const mergedFrame&),
+    // until it returns false
+    template <class Fn>
+    void run(Fn fn)
+    {
+        typedef std::pair<int64_t, size_t> head;    // time, srcs_ index
+        std::priority_queue<head, std::vector<head>, std::greater<head>> heap;
+        size_t nxt = 0;         // next file to join the merge
+        size_t started = 0;     // next file to start reading
+        for (;;) {
+            for (; started < srcs_.size() && started < nxt + PCAPMERGE_PREFETCH;
+                 started++) {
+                source* s = srcs_[started].get();
+                s->reader = std::thread(&pcapMerge::read, this, s);
+            }
+            if (nxt < srcs_.size() &&
+                (heap.empty() || srcs_[nxt]->first <= heap.top().first)) {
+                if (nextFrame(*srcs_[nxt])) {
+                    heap.push(head(srcs_[nxt]->time(), nxt));
+                }
+                nxt++;
+                continue;
+            }
+            if (heap.empty()) {
+                break;
+            }
+            size_t i = heap.top().second;
+            heap.pop();
+            source& s = *srcs_[i];
+            const frame& f = s.cur->frames[s.idx];
+            mergedFrame mf = {s.cur->data.data() + f.off, f.caplen, f.dlt,
+                              f.sec, f.nsec};
+            if (!fn(mf)) {
+                return;
+            }
+            s.idx++;
+            if (nextFrame(s)) {
+                heap.push(head(s.time(), i));
+            }
+        }
+    }
+
+  private:
+    struct frame
+    {
+        size_t off;
+        uint32_t caplen;
+        int dlt;            // (a pcapng file's interfaces may differ)
+        int64_t sec;
+        int64_t nsec;
+    };
+
+    struct chunk
+    {
+        std::vector<uint8_t> data;
+        std::vector<frame> frames;
+    };
+
+    struct source
+    {
+        std::string name;
+        int dlt{};
+        int64_t first{};        // first frame's time, ns
+        std::thread reader;
+        spscRing<chunk*> queue{PCAPMERGE_QUEUE};
+        std::atomic<bool> eof{false};
+        std::unique_ptr<chunk> cur;     // (merge side)
+        size_t idx{};
+
+        int64_t time() const
+        {
+            const frame& f = cur->frames[idx];
+            return f.sec * 1000000000 + f.nsec;
+        }
+    };
+
+    // reader thread of source 's'
+    void read(source* s)
+    {
+        try {
+            capFile cf(s->name);
+            capFilter filter(filter_);
+            std::unique_ptr<chunk> c(new chunk);
+            c->data.reserve(PCAPMERGE_CHUNK + 65536);
+            capFrame fr;
+            while (!stop_ && cf.next(fr)) {
+                // (frames the raw parser can't take are passed on
+                // unfiltered, for the caller to count)
+                if (rawParseDlt(fr.dlt) && (!filter.compiles(fr.dlt) ||
+                                            !filter.match(fr))) {
+                    continue;
+                }
+                c->frames.push_back(frame{c->data.size(), fr.caplen, fr.dlt,
+                                          fr.sec, fr.nsec});
+                c->data.insert(c->data.end(), fr.data, fr.data + fr.caplen);
+                if (c->data.size() >= PCAPMERGE_CHUNK) {
+                    hand(s, c.release());
+                    c.reset(new chunk);
+                    c->data.reserve(PCAPMERGE_CHUNK + 65536);
+                }
+            }
+            if (!cf.error().empty()) {
+                std::cerr << cf.error() << "\n";
+            }
+            if (!filter.error().empty()) {
+                std::cerr << s->name << ": " << filter.error() << "\n";
+            }
+            if (!c->frames.empty()) {
+                hand(s, c.release());
+            }
+        } catch (std::exception& ex) {
+            std::cerr << ex.what() << "\n";
+        }
+        s->eof.store(true, std::memory_order_release);
+    }
+
+    void hand(source* s, chunk* c)
+    {
+        while (!s->queue.push(c)) {
+            if (stop_) {
+                delete c;
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    // make s.cur[s.idx] the source's next frame, waiting for its reader
+    // if need be; false at the end of the file
+    bool nextFrame(source& s)
+    {
+        while (!s.cur || s.idx >= s.cur->frames.size()) {
+            // (eof is set after the last push, so it's read first)
+            bool eof = s.eof.load(std::memory_order_acquire);
+            chunk* c;
+            if (s.queue.pop(&c, 1) == 1) {
+                s.cur.reset(c);
+                s.idx = 0;
+            } else if (eof) {
+                s.cur.reset();
+                s.reader.join();
+                return false;
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+        return true;
+    }
+
+    std::string filter_;
+    std::vector<std::unique_ptr<source>> srcs_;
+    std::atomic<bool> stop_{false};
+};
+
+#endif
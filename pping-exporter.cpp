@@ -63,34 +63,161 @@
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 #include <ifaddrs.h>
+#include <poll.h>
 #include <pcap.h>
 #include <ctime>
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include <algorithm>
 #include <utility>
+#include <vector>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include "tins/tins.h"
+#include "afpacket.h"
+#include "tcpparse.h"
+#include "spscring.h"
+#include "output.h"
+#include "lpm.h"
+#include "capfile.h"
+#include "flowsnap.h"
+#include "pcapmerge.h"
+#include "rttstats.h"
+#ifdef PPING_BENCH
+#include <fcntl.h>
+#include "bench.h"
+#endif
+#ifdef PPING_WITH_BPF
+#include "bpfmatcher.h"
+#endif
 #include <signal.h>
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <chrono>
 
-#include "promClient.h"
+#include "promexport.h"
+#include "labelagg.h"
 
+using namespace std;
 using namespace Tins;
-using namespace EasyProm;
 
-class flowRec
+// is the 16 byte address 'a' an IPv4 address (v4-mapped)
+static inline bool isV4Mapped(const uint8_t* a)
 {
-  public:
-    explicit flowRec(std::string nm)
+    static const uint8_t v4pfx[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+    return memcmp(a, v4pfx, sizeof(v4pfx)) == 0;
+}
+
+// Fixed-size binary flow key (the 5-tuple minus the protocol, which is
+// always TCP). IPv4 addresses are stored v4-mapped (::ffff:a.b.c.d) so
+// both families share one layout. Ports are in host byte order.
+// Could add DSCP field to key.
+struct flowKey
+{
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+
+    bool isV4() const { return isV4Mapped(src); }
+
+    flowKey reversed() const
     {
-        flowname = std::move(nm);
-    };
-    ~flowRec() = default;
+        flowKey r;
+        memcpy(r.src, dst, sizeof(r.src));
+        memcpy(r.dst, src, sizeof(r.dst));
+        r.sport = dport;
+        r.dport = sport;
+        return r;
+    }
+
+    bool operator==(const flowKey& o) const
+    {
+        return memcmp(this, &o, sizeof(*this)) == 0;
+    }
+};
+
+static inline void setV4Addr(uint8_t* a, uint32_t ip)   // ip in network order
+{
+    memset(a, 0, 10);
+    a[10] = a[11] = 0xff;
+    memcpy(a + 12, &ip, sizeof(ip));
+}
+
+static inline uint64_t mix64(uint64_t h)
+{
+    // murmur3 / splitmix64 style finalizer
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+struct flowKeyHash
+{
+    size_t operator()(const flowKey& k) const
+    {
+        uint64_t w[4];
+        uint32_t p = (uint32_t(k.sport) << 16) | k.dport;
+        memcpy(w, &k, sizeof(w));    // src and dst addresses
+        return mix64((w[0] ^ w[2] * 0x9e3779b97f4a7c15ULL) +
+                     (w[1] ^ w[3] * 0xbf58476d1ce4e5b9ULL) + p);
+    }
+};
+
+// (flow-id, TSval) key for the TSval table. The flow-id of a flow and
+// of its reverse differ only in the low bit (see process_packet) so the
+// ECR lookup needs no second flow table access.
+struct tsKey
+{
+    uint32_t flow;
+    uint32_t tsval;
+
+    uint64_t packed() const { return (uint64_t(flow) << 32) | tsval; }
+};
+
+static std::string addrToString(const uint8_t* a, bool v4)
+{
+    char buf[INET6_ADDRSTRLEN];
+    inet_ntop(v4 ? AF_INET : AF_INET6, v4 ? a + 12 : a, buf, sizeof(buf));
+    return buf;
+}
+
+// text form of a flow: srcIP:port+dstIP:port
+static std::string flowToString(const flowKey& k)
+{
+    bool v4 = k.isV4();
+    return addrToString(k.src, v4) + ":" + std::to_string(k.sport) + "+" +
+           addrToString(k.dst, v4) + ":" + std::to_string(k.dport);
+}
+
+// A flow's handle on its RTT series, plus what's needed to keep the
+// series' labels current when sources are ranked (--topSrc)
+struct seriesRef
+{
+    rttSeries* series{};
+    std::string src;        // srcIP label value before top-K
+    uint32_t gen{};         // srcLabels generation the labels were set at
+    uint32_t unranked{};    // samples not yet counted by srcLabels
+};
 
-    std::string flowname;
+#define NO_FLOW 0xffffffffu         // flowRec::rev when there's no reverse flow
+#define CLOCK_SCAN 32               // records an eviction looks at, if need be
+
+class flowRec
+{
+  public:
+    flowKey key;
+    uint32_t id{};      // flow-id used in tsTbl keys
+    uint32_t rev{NO_FLOW};  // flowTable index of the reverse flow's record
     double last_tm{};
     double min{1e30};   // current min value for capturepoint-to-source RTT
     double bytesSnt{};  // number of bytes sent through CP toward dst
@@ -103,71 +230,718 @@ class flowRec
                         // match on TSval entry by reverse flow, i.e. the number of bytes
                         // departed through CP the last time an RTT was computed for this stream
     bool revFlow{};             //inidcates if a reverse flow has been seen
+    bool exported{};            // RTTs were handed to the metricUpdater
+    bool ref{};                 // used since the eviction sweep passed it
+
+    // RTT sampling (--sampleRate, --sampleEvery, --sampleDelta)
+    double smplWin{-1e30};      // start of the current 1 second window
+    uint32_t smplWinCnt{};      // samples kept in it
+    uint32_t smplWinSkip{};     // and skipped by the rate or 1-in-K limit
+    uint32_t matches{};         // RTT matches so far
+    bool thinTs{};              // samples were skipped in the previous
+                                // window: only record 1 in TS_THIN TSvals
+    uint32_t lastTsval{};       // most recent TSval of this direction
+    uint32_t nTsvals{};         // distinct TSvals seen while thinning
+
+    rttStats stats;             // (--flowStats) of every RTT matched
 };
 
-class tsInfo
+// The time of a TSval's first packet is kept as the low 31 bits of its
+// capture time in TS_TICK_NS ticks, so ages are only right modulo
+// TS_WRAP seconds. Entries never get that old: they go after
+// tsvalMaxAge (at most TS_MAX_AGE), and after a gap in capture time of
+// over half of TS_WRAP all of them do (see cleanUp()).
+#define TS_TICK_NS 256
+#define TS_WRAP 549.755813888       // 2^31 ticks
+#define TS_MAX_AGE 240.
+
+struct tsInfo
 {
-  public:
-    explicit tsInfo(double tm, double f, double d)
-        : t{tm}, fBytes{f}, dBytes{d} {};
-    ~tsInfo() {};
-    double t;       //wall clock time of new TSval pkt arrival
+    uint32_t tm;        // capture time of the TSval's first packet, as
+                        // stamp(); the low bit is set once it's matched
+    uint32_t seqEnd;    // (--seqMatch) seq just past that packet's data
     double fBytes;  //total bytes of flow through CP including this pkt
     double dBytes;  //total bytes of in
+
+    static uint32_t stamp(int64_t capNs)
+    {
+        return uint32_t(uint64_t(capNs / TS_TICK_NS) << 1);
+    }
+    // ns from the first packet to capture time 'capNs' (a multiple of
+    // TS_TICK_NS); negative if 'capNs' is before it, as a packet
+    // captured on another interface can be
+    int64_t age(int64_t capNs) const
+    {
+        return int64_t(int32_t(stamp(capNs) - (tm & ~1u)) / 2) * TS_TICK_NS;
+    }
+    bool used() const { return (tm & 1) != 0; }
+    void markUsed() { tm |= 1; }
+};
+
+// Flat open-addressed (Robin Hood, linear probing) TSval table with the
+// tsInfo stored inline. An entry is 32 bytes and the slot array is cache
+// line aligned, so a lookup or insert normally touches a single line.
+// The number of entries is bounded by 'maxEntries' (--maxTsEntries); the
+// slot count is sized once, up front, to keep the load factor <= 7/8.
+// Deletion uses backward shifting so there are no tombstones. A packed
+// key of 0 marks an empty slot (TSvals of 0 are never stored).
+class tsTable
+{
+  public:
+    explicit tsTable(size_t maxEntries)
+    {
+        size_t n = 16;
+        while (n - n / 8 < maxEntries) {
+            n <<= 1;
+        }
+        void* p = nullptr;
+        if (posix_memalign(&p, 64, n * sizeof(entry)) != 0) {
+            throw std::bad_alloc();
+        }
+        memset(p, 0, n * sizeof(entry));
+        slots_ = static_cast<entry*>(p);
+        mask_ = n - 1;
+        maxSize_ = maxEntries;
+    }
+    ~tsTable() { free(slots_); }
+    tsTable(const tsTable&) = delete;
+    tsTable& operator=(const tsTable&) = delete;
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return maxSize_; }
+
+    // start loading the line 'key' would be found in
+    void prefetch(const tsKey& key) const
+    {
+        __builtin_prefetch(&slots_[home(key.packed())]);
+    }
+
+    tsInfo* find(const tsKey& key)
+    {
+        uint64_t k = key.packed();
+        if (k == 0) {
+            return nullptr;
+        }
+        for (size_t i = home(k), d = 0; ; i = (i + 1) & mask_, d++) {
+            entry& e = slots_[i];
+            if (e.key == k) {
+                return &e.ti;
+            }
+            if (e.key == 0 || dist(e.key, i) < d) {
+                return nullptr;
+            }
+        }
+    }
+
+    // insert 'ti' under 'key' unless the key is already present. Returns
+    // the entry for 'key' (existing or new, or nullptr if the table is
+    // full) and whether an insert took place.
+    std::pair<tsInfo*, bool> tryEmplace(const tsKey& key, const tsInfo& ti)
+    {
+        uint64_t k = key.packed();
+        size_t i = home(k), d = 0;
+        for (; ; i = (i + 1) & mask_, d++) {
+            entry& e = slots_[i];
+            if (e.key == k) {
+                return {&e.ti, false};
+            }
+            if (e.key == 0 || dist(e.key, i) < d) {
+                break;
+            }
+        }
+        if (size_ >= maxSize_ || k == 0) {
+            return {nullptr, false};
+        }
+        // i is where the new entry belongs; push the poorer entries
+        // from here up to the next empty slot one slot forward.
+        entry* res = &slots_[i];
+        entry ins{k, ti};
+        while (slots_[i].key != 0) {
+            std::swap(ins, slots_[i]);
+            i = (i + 1) & mask_;
+        }
+        slots_[i] = ins;
+        size_++;
+        return {&res->ti, true};
+    }
+
+    bool erase(const tsKey& key)
+    {
+        uint64_t k = key.packed();
+        if (k == 0) {
+            return false;
+        }
+        for (size_t i = home(k), d = 0; ; i = (i + 1) & mask_, d++) {
+            uint64_t ek = slots_[i].key;
+            if (ek == k) {
+                eraseAt(i);
+                return true;
+            }
+            if (ek == 0 || dist(ek, i) < d) {
+                return false;
+            }
+        }
+    }
+
+  private:
+    struct entry
+    {
+        uint64_t key;
+        tsInfo ti;
+    };
+
+    size_t home(uint64_t k) const { return mix64(k) & mask_; }
+    size_t dist(uint64_t k, size_t i) const { return (i - home(k)) & mask_; }
+
+    void eraseAt(size_t i)
+    {
+        for (size_t j = (i + 1) & mask_;
+             slots_[j].key != 0 && dist(slots_[j].key, j) != 0;
+             i = j, j = (j + 1) & mask_) {
+            slots_[i] = slots_[j];
+        }
+        slots_[i].key = 0;
+        size_--;
+    }
+
+    entry* slots_;
+    size_t mask_;
+    size_t size_{};
+    size_t maxSize_;
+};
+
+// Flow table with a fixed number of records. The flowRecs live in one
+// slab allocated up front (sized by --maxFlows) and are recycled through
+// a free list, so creating and deleting flows never touches malloc and
+// the table's footprint doesn't change. Records are referred to by
+// their slab index. The index itself is a Robin Hood hash like tsTable's,
+// of (slab index, hash) slots; the hash is checked before a record's key
+// so a probe rarely touches a record that doesn't match.
+class flowTable
+{
+  public:
+    explicit flowTable(size_t maxFlows) : slab_(maxFlows), gen_(maxFlows)
+    {
+        size_t n = 16;
+        while (n < 2 * maxFlows) {
+            n <<= 1;
+        }
+        slots_.assign(n, slot{NO_FLOW, 0});
+        mask_ = n - 1;
+        free_.reserve(maxFlows);
+        for (size_t i = maxFlows; i-- > 0; ) {
+            free_.push_back(uint32_t(i));
+        }
+    }
+
+    size_t size() const { return slab_.size() - free_.size(); }
+    size_t capacity() const { return slab_.size(); }
+
+    flowRec& at(uint32_t i) { return slab_[i]; }
+    uint32_t indexOf(const flowRec* fr) const { return uint32_t(fr - slab_.data()); }
+
+    // start loading the index slot of 'k' and then, once that's in, the
+    // record it points at (most likely k's)
+    void prefetchSlot(const flowKey& k) const
+    {
+        __builtin_prefetch(&slots_[hash(k) & mask_]);
+    }
+    void prefetchRecord(const flowKey& k) const
+    {
+        const slot& e = slots_[hash(k) & mask_];
+        if (e.idx != NO_FLOW) {
+            __builtin_prefetch(&slab_[e.idx]);
+        }
+    }
+
+    flowRec* find(const flowKey& k)
+    {
+        uint32_t h = hash(k);
+        for (size_t i = h & mask_, d = 0; ; i = (i + 1) & mask_, d++) {
+            const slot& e = slots_[i];
+            if (e.idx == NO_FLOW || dist(e.hash, i) < d) {
+                return nullptr;
+            }
+            if (e.hash == h && slab_[e.idx].key == k) {
+                return &slab_[e.idx];
+            }
+        }
+    }
+
+    // a fresh record for 'k' (which mustn't be in the table), or nullptr
+    // if all records are in use
+    flowRec* insert(const flowKey& k)
+    {
+        if (free_.empty()) {
+            return nullptr;
+        }
+        uint32_t idx = free_.back();
+        free_.pop_back();
+        gen_[idx]++;
+        flowRec& fr = slab_[idx];
+        fr = flowRec();
+        fr.key = k;
+        fr.ref = true;      // (so the sweep gives it a chance to be used)
+
+        slot ins{idx, hash(k)};
+        size_t i = ins.hash & mask_;
+        for (size_t d = 0; slots_[i].idx != NO_FLOW; i = (i + 1) & mask_, d++) {
+            size_t ed = dist(slots_[i].hash, i);
+            if (ed < d) {
+                std::swap(ins, slots_[i]);
+                d = ed;
+            }
+        }
+        slots_[i] = ins;
+        return &fr;
+    }
+
+    void erase(flowRec* fr)
+    {
+        uint32_t idx = indexOf(fr);
+        uint32_t h = hash(fr->key);
+        for (size_t i = h & mask_; slots_[i].idx != NO_FLOW; i = (i + 1) & mask_) {
+            if (slots_[i].idx == idx) {
+                eraseAt(i);
+                break;
+            }
+        }
+        gen_[idx]++;
+        free_.push_back(idx);
+    }
+
+    // generation of record 'i': odd while it's in use, and bumped by every
+    // insert and erase, so a stale reference to a reused record shows
+    uint32_t gen(uint32_t i) const { return gen_[i]; }
+
+    // The record to evict (other than 'keep') when all are in use. A
+    // CLOCK sweep: records used since the hand last passed get another
+    // round. The first unused uni-directional flow it comes to (one that
+    // can't give RTTs) goes, or failing that the stalest unused flow of
+    // the next CLOCK_SCAN records. O(1) amortized: each record's bit is
+    // only cleared once per pass.
+    flowRec* victim(const flowRec* keep)
+    {
+        flowRec* best = nullptr;
+        // (two passes are enough to find one, if there's any but 'keep')
+        size_t maxScan = 2 * slab_.size() + 1;
+        for (size_t n = 0; (n < CLOCK_SCAN || best == nullptr) && n < maxScan;
+             n++) {
+            flowRec& fr = slab_[hand_];
+            hand_ = (hand_ + 1 == slab_.size()) ? 0 : hand_ + 1;
+            if ((gen_[indexOf(&fr)] & 1) == 0 || &fr == keep) {
+                continue;
+            }
+            if (fr.ref) {
+                fr.ref = false;
+                continue;
+            }
+            if (!fr.revFlow) {
+                return &fr;
+            }
+            if (best == nullptr || fr.last_tm < best->last_tm) {
+                best = &fr;
+            }
+        }
+        return best;
+    }
+
+  private:
+    struct slot
+    {
+        uint32_t idx;       // into slab_, NO_FLOW if the slot is empty
+        uint32_t hash;
+    };
+
+    static uint32_t hash(const flowKey& k) { return uint32_t(flowKeyHash()(k)); }
+    size_t dist(uint32_t h, size_t i) const { return (i - h) & mask_; }
+
+    void eraseAt(size_t i)
+    {
+        for (size_t j = (i + 1) & mask_;
+             slots_[j].idx != NO_FLOW && dist(slots_[j].hash, j) != 0;
+             i = j, j = (j + 1) & mask_) {
+            slots_[i] = slots_[j];
+        }
+        slots_[i].idx = NO_FLOW;
+    }
+
+    std::vector<flowRec> slab_;
+    std::vector<uint32_t> gen_;     // per record, see gen()
+    size_t hand_{};                 // of the eviction sweep
+    std::vector<uint32_t> free_;    // unused slab indices
+    std::vector<slot> slots_;
+    size_t mask_;
+};
+
+// Ring of time buckets used to age out table entries without scanning
+// the tables. An item is filed in the bucket covering the time at which
+// it may expire and, as capture time advances past a bucket, the bucket's
+// items are handed to a callback that checks whether each has really
+// expired (it may have been refreshed or removed since it was filed) and
+// either drops it or files it again. So each tick costs time proportional
+// to the number of items that come due, not to the size of the tables.
+// Items due further ahead than the ring spans go in the last bucket and
+// are simply re-filed when it comes around.
+template <class T>
+class expiryWheel
+{
+  public:
+    expiryWheel(double tick, size_t nBuckets)
+        : tick_{tick}, buckets_(nBuckets) {}
+
+    // file 'item' to be looked at once capture time reaches 'when'
+    void schedule(const T& item, double when)
+    {
+        int64_t tk = static_cast<int64_t>(when / tick_);
+        int64_t n = static_cast<int64_t>(buckets_.size());
+        if (tk <= cur_) {
+            tk = cur_ + 1;
+        } else if (tk >= cur_ + n) {
+            tk = cur_ + n - 1;
+        }
+        buckets_[tk % n].push_back(item);
+    }
+
+    // hand every item in the buckets up to time 'now' to fn(item)
+    template <class Fn>
+    void advance(double now, Fn fn)
+    {
+        int64_t target = static_cast<int64_t>(now / tick_);
+        int64_t n = static_cast<int64_t>(buckets_.size());
+        if (target - cur_ > n) {
+            cur_ = target - n;  // every bucket is visited once below
+        }
+        while (cur_ < target) {
+            ++cur_;
+            // swap the bucket out so fn() can re-file items while we
+            // walk it; both vectors keep their storage for reuse
+            std::vector<T>& b = buckets_[cur_ % n];
+            work_.swap(b);
+            for (const T& item : work_) {
+                fn(item);
+            }
+            work_.clear();
+            work_.swap(b);
+        }
+    }
+
+  private:
+    double tick_;
+    int64_t cur_{};     // last tick processed
+    std::vector<std::vector<T>> buckets_;
+    std::vector<T> work_;
 };
 
-static std::unordered_map<std::string, flowRec*> flows;
-static std::unordered_map<std::string, tsInfo*> tsTbl;
+#define WHEEL_BUCKETS 32
 
 #define SNAP_LEN 144                // maximum bytes per packet to capture
 static double tsvalMaxAge = 10.;    // limit age of TSvals to use
 static double flowMaxIdle = 300.;   // flow idle time until flow forgotten
 static double sumInt = 10.;         // how often (sec) to print summary line
 static int maxFlows = 10000;
-static int flowCnt;
+static size_t maxTsEntries = 500000;
+static int nThreads = 1;        // number of flow table shards / workers
 static double time_to_run;      // how many seconds to capture (0=no limit)
 static int maxPackets;          // max packets to capture (0=no limit)
 static int64_t offTm = -1;      // first packet capture time (used to
                                 // avoid precision loss when 52 bit timestamp
                                 // normalized into FP double 47 bit mantissa)
 static bool machineReadable = false; // machine or human readable output
+static std::string outFormat("text");   // --output: text, csv or binary
 static double capTm, startm;        // (in seconds)
-static int pktCnt, not_tcp, no_TS, not_v4or6, uniDir;
-static IPv4Address localIP;         // ignore pp through this address
 static bool filtLocal = true;
 static std::string filter("tcp");    // default bpf filter
+
+// Added to the filter of a live capture (unless --noTsPrefilter) so the
+// kernel drops the TCP packets that can't give or match an RTT: those
+// without a timestamp option as the first option, after two NOPs (where
+// every stack puts it, except in SYNs), or with a zero TSval or ECR.
+// SYNs always pass as their options are often packed differently, as do
+// IPv6 packets with extension headers.
+static bool tsPrefilter = true;
+static const char tsFilter[] =
+    "(ip and (tcp[13] & 2 != 0 or (tcp[12] >= 0x80 and "
+    "tcp[20:4] = 0x0101080a and tcp[24:4] != 0 and tcp[28:4] != 0))) or "
+    "(ip6 and (ip6[6] != 6 or ip6[53] & 2 != 0 or (ip6[52] >= 0x80 and "
+    "ip6[60:4] = 0x0101080a and ip6[64:4] != 0 and ip6[68:4] != 0)))";
 static int64_t flushInt = 1000000;  // stdout flush interval (~uS)
-static vector<IPv4Range> localRanges; // Similar to 'localIP', but for other
-                                      // addresses/ranges. This is useful
-                                      // in hosts acting as routers or NATs.
+static sampleWriter* sampleOut;     // where RTT samples go (created in main())
+static int sampleRate;              // max samples per flow per second (0=all)
+static int sampleEvery = 1;         // keep 1 in this many samples per flow
+static double sampleDelta;          // keep only RTTs this fraction over min
+static double statsInt;             // --flowStats publishing interval (0=off)
+static bool seqMatch;               // --seqMatch: ACKs must cover the TSval
+static std::string snapFile;        // --flowSnapshot file (""=none)
+static double snapInt = 60.;        // how often (sec) it's written
+static prefixSet localNets;         // ignore pp through these addresses:
+                                    // the interface's own plus the -L
+                                    // ranges (useful in routers or NATs)
 
 // Prometheus-related variables
 static std::string listenAddr(":9876"); // HTTP endpoint for Prometheus to scrape
 static vector<std::string> strRanges; // Temp for optargs
-static SummaryVec flowSummaryVec; // Will be instantiated later in main()
+static metricType rttMetricType = METRIC_SUMMARY;
+static labelRules srcLabels;        // --srcPrefix, --srcGroup, --topSrc
+static std::unique_ptr<metricFamily> rttMetric; // created in main(), one
+                                                 // shard per worker
+static std::unique_ptr<metricFamily> procMetric; // packet processing time
+                                                 // (likewise)
+
+// Event counter written by a single thread and read (e.g. by
+// printSummary()) from others. Increments are plain relaxed load/store
+// pairs, not locked read-modify-writes.
+class counter
+{
+  public:
+    void operator++(int) { add(1); }
+    void operator--(int) { add(-1); }
+    void add(int64_t n)
+    {
+        v_.store(v_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+    }
+    int64_t get() const { return v_.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<int64_t> v_{0};
+};
+
+// Packet counters of the capture thread. They only ever go up (they're
+// exported as Prometheus counters); printSummary() reports the change
+// since its previous report.
+static counter pktCnt, not_tcp, no_TS, not_v4or6;
+static counter samplesLost;         // (eBPF mode) ring buffer was full
+static counter kernelDrops;         // pcap / AF_PACKET drops
+static counter kernelFiltered;      // dropped by the kernel's tsFilter
+
+#define LAT_SAMPLE 16   // time the processing of 1 in this many packets
+#define BURST 32        // packets parsed / processed together
+#define TS_THIN 4       // TSvals recorded 1 in this many while sampling
+
+// What ppWorker::process() needs from a TCP packet with a timestamp
+// option. Built on the capture thread, so it's all a worker sees.
+struct pktInfo
+{
+    flowKey key;
+    uint32_t tsval;
+    uint32_t ecr;
+    uint32_t size;      // bytes on the wire (0: no packet, a clock tick)
+    uint32_t seqEnd;    // seq just past the packet's data
+    uint32_t ack;
+    int64_t capNs;      // capture time, ns since offTm
+};
+
+// A flow's rttStats as of the end of a --flowStats interval
+struct flowStatsRec
+{
+    flowKey key;
+    uint32_t count;
+    double srtt, stddev, min, max, p50, p95;    // seconds
+};
+
+// Symmetric flow hash: both directions of a connection give the same
+// value, so they land in the same shard.
+static inline uint64_t shardHash(const flowKey& k)
+{
+    uint64_t w[4];
+    memcpy(w, &k, sizeof(w));
+    return mix64((w[0] ^ w[2]) * 0x9e3779b97f4a7c15ULL + (w[1] ^ w[3]) +
+                 (uint32_t(k.sport) ^ k.dport));
+}
+
+// --flowAdmit: the directions seen of connections that aren't tracked
+// yet, so a flow record is only made for one seen both ways. Each cell
+// of the (count-min style) sketch is a mask of directions; a connection
+// hashes to a cell per row and has been seen both ways if all its cells
+// say so. Collisions only ever admit early. The sketch is cleared every
+// ADMIT_RESET seconds so it doesn't fill up (e.g. in a SYN flood).
+#define ADMIT_ROWS 4
+#define ADMIT_RESET 10.
+
+class dirSketch
+{
+  public:
+    explicit dirSketch(size_t minCells)
+    {
+        size_t n = 4096;
+        while (n < minCells) {
+            n <<= 1;
+        }
+        cells_.assign(ADMIT_ROWS * n, 0);
+        mask_ = n - 1;
+    }
+
+    // note a packet of flow 'k'; true once its reverse has been seen too
+    bool see(const flowKey& k)
+    {
+        uint64_t h = shardHash(k);
+        uint32_t h1 = uint32_t(h), h2 = uint32_t(h >> 32) | 1;
+        int c = memcmp(k.src, k.dst, sizeof(k.src));
+        uint8_t dir = (c < 0 || (c == 0 && k.sport < k.dport)) ? 1 : 2;
+        uint8_t all = 3;
+        for (size_t i = 0; i < ADMIT_ROWS; i++) {
+            uint8_t& cell = cells_[i * (mask_ + 1) + ((h1 + i * h2) & mask_)];
+            cell |= dir;
+            all &= cell;
+        }
+        return all == 3;
+    }
+
+    void clear() { std::fill(cells_.begin(), cells_.end(), 0); }
+
+  private:
+    std::vector<uint8_t> cells_;
+    size_t mask_;
+};
+
+static bool flowAdmit;      // --flowAdmit
+
+// a flowWheel entry: a flowTable record, as of its generation
+struct flowTick
+{
+    uint32_t idx;
+    uint32_t gen;
+};
+
+// One shard of the flow state. Each worker owns its own flow table, TSval
+// table and expiry wheels and is driven by a single thread, so nothing
+// in here needs locking; its counters are the only thing other threads
+// read.
+class ppWorker
+{
+  public:
+    // 'outQ' is the worker's output and metric update queue, 'procLat'
+    // the shard for its packet processing times
+    ppWorker(int maxFlows, size_t maxTsEntries, metricShard& procLat,
+             size_t outQ)
+        : procLat_{procLat.acquire("")}, outQ_{outQ},
+          flows(maxFlows), tsTbl(maxTsEntries),
+          // ticks are 1/16 of the max age so the wheels span twice the max age
+          tsWheel(std::max(tsvalMaxAge, 1e-3) / (WHEEL_BUCKETS / 2),
+                  WHEEL_BUCKETS),
+          flowWheel(std::max(flowMaxIdle, 1e-3) / (WHEEL_BUCKETS / 2),
+                    WHEEL_BUCKETS)
+    {
+        if (flowAdmit) {
+            admit_.reset(new dirSketch(4 * size_t(maxFlows)));
+        }
+        if (statsInt > 0.) {
+            // (so that adding to them never allocates)
+            statsFlows_.reserve(maxFlows);
+            statsNext_.reserve(maxFlows);
+            statsPub_.reserve(maxFlows);
+        }
+    }
+
+    void process(const pktInfo& pi)
+    {
+        if ((nProcessed_++ & (LAT_SAMPLE - 1)) != 0) {
+            processPkt(pi);
+            return;
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        processPkt(pi);
+        procLat_->observe(std::chrono::duration<double, std::micro>(
+                              std::chrono::steady_clock::now() - t0).count());
+    }
+    void processBurst(const pktInfo* p, size_t n);
+    void cleanUp(double n);
+
+    // packets owned by this worker are handed over through 'ring'
+    // (unused when there is only one worker)
+    void run();
+    std::unique_ptr<spscRing<pktInfo>> ring;
+    std::thread thread;
+
+    counter flowCnt, uniDir, tsTblFull, samples;
+    counter sampledOut;         // RTT matches skipped by the sampling policy
+    counter metricsDropped;     // RTTs not exported, metric queue was full
+    counter flowsEvicted;       // flows deleted to make room for new ones
+    counter tsCnt;              // TSval table entries
+    counter cleanNs;            // time spent in cleanUp()
+    size_t tsCapacity() const { return tsTbl.capacity(); }
+
+    // append the flow stats published at the end of the last interval
+    void collectStats(std::vector<flowStatsRec>& out)
+    {
+        std::lock_guard<std::mutex> lk(statsMtx_);
+        out.insert(out.end(), statsPub_.begin(), statsPub_.end());
+    }
+
+    // (--flowSnapshot) append the worker's bi-directional flows: as they
+    // were published at the end of the last interval, or as they are
+    // (only from the worker's own thread, or once it has stopped)
+    void collectSnapshot(std::vector<flowSnapRec>& out)
+    {
+        std::lock_guard<std::mutex> lk(snapMtx_);
+        out.insert(out.end(), snapPub_.begin(), snapPub_.end());
+    }
+    void snapshot(std::vector<flowSnapRec>& out);
+    bool restoreFlow(const flowKey& key, const flowSnapRec& r, double lastTm);
+
+  private:
+    void processPkt(const pktInfo& pi);
+    void addTS(const tsKey& key, const tsInfo& ti, double capTm);
+    tsInfo* getTStm(const tsKey& key);
+    bool keepSample(flowRec* fr, double rtt, double capTm);
+    void publishStats();
+    void publishSnapshot();
+    flowRec* newFlow(const flowKey& key, double capTm, const flowRec* keep);
+    void removeFlow(flowRec* fr);
+
+    rttSeries* procLat_;
+    uint64_t nProcessed_{};
+    size_t outQ_;
+    uint32_t nxtFlowId{};       // next unused flow-id pair (always even)
+    double nxtClean{};
+    flowTable flows;
+    tsTable tsTbl;
+    // aging of tsTbl and flows entries. Each flow has one live entry in
+    // flowWheel (ones left by an evicted flow are stale: the record's
+    // generation has moved on); each tsTbl insert files one in tsWheel.
+    expiryWheel<tsKey> tsWheel;
+    double tsCleaned_{};        // capture time tsWheel was last advanced to
+    expiryWheel<flowTick> flowWheel;
+    std::unique_ptr<dirSketch> admit_;  // (--flowAdmit)
+    double nxtAdmitReset_{};
+
+    // flows with RTTs in the current --flowStats interval (by flowTable
+    // index; a flow deleted since is skipped, through its count of 0)
+    std::vector<uint32_t> statsFlows_;
+    double nxtStats_{};
+    std::vector<flowStatsRec> statsNext_;   // being built
+    std::mutex statsMtx_;
+    std::vector<flowStatsRec> statsPub_;    // what scrapes see
+
+    double nxtSnap_{};
+    std::vector<flowSnapRec> snapNext_;     // being built
+    std::mutex snapMtx_;
+    std::vector<flowSnapRec> snapPub_;      // what the snapshot writer sees
+};
+
+static std::vector<std::unique_ptr<ppWorker>> workers;  // created in main()
+static std::atomic<bool> captureDone{false};    // no more packets for workers
 
 // save capture time of packet using its flow + TSval as key.  If key
 // exists, don't change it.  The same TSval may appear on multiple
 // packets so this retains the first (oldest) appearance which may
 // overestimate RTT but won't underestimate. This slight bias may be
-// reduced by adding additional fields to the key (such as packet's
-// ending tcp_seq to match against returned tcp_ack) but this can
-// substantially increase the state burden for a small improvement.
+// reduced by also checking the packet's ending tcp_seq against the
+// returning tcp_ack (--seqMatch). The entry has room for it since its
+// time is kept as 32 bits, so that costs no state.
 
-static inline void addTS(const std::string& key, tsInfo* ti)
+void ppWorker::addTS(const tsKey& key, const tsInfo& ti, double capTm)
 {
-    bool empSuccess = false;
-#ifdef __cpp_lib_unordered_map_try_emplace
-    empSuccess = tsTbl.try_emplace(key, ti).second;
-#else
-    if (tsTbl.count(key) == 0) {
-        empSuccess = tsTbl.emplace(key, ti).second;
+    // the table never grows: if it is out of room the TSval just isn't
+    // recorded until cleanUp() frees some entries
+    auto res = tsTbl.tryEmplace(key, ti);
+    if (res.second) {
+        tsCnt++;
+        tsWheel.schedule(key, capTm + tsvalMaxAge);
+    } else if (res.first == nullptr) {
+        tsTblFull++;
     }
-#endif
-
-    // Check if emplace succeeded; delete object if it did not
-    if (!empSuccess)
-        delete ti;
 }
 
 // A packet's ECR (timestamp echo reply) should match the TSval of some
@@ -185,17 +959,138 @@ static inline void addTS(const std::string& key, tsInfo* ti)
 //  a) longer than the largest time between TSval ticks
 //  b) longer than longest queue wait packets are expected to experience
 
-static inline tsInfo* getTStm(const std::string& key)
+inline tsInfo* ppWorker::getTStm(const tsKey& key)
 {
-    try {
-        tsInfo* ti = tsTbl.at(key);
-        return ti;
-    } catch (std::out_of_range const&) {
-        return nullptr;
+    return tsTbl.find(key);
+}
+
+// Whether an RTT sample of flow 'fr' goes out, under the sampling
+// policy. It's called before the sample is counted in fr->min, which
+// still holds the min from before it: that's how a new min is told
+// (and what --sampleDelta compares to). A new min always goes out; so
+// does the first sample of a flow. Samples of elephant flows add little
+// apart from min changes, so this is what keeps their output and
+// Prometheus cost down.
+inline bool ppWorker::keepSample(flowRec* fr, double rtt, double capTm)
+{
+    if (capTm - fr->smplWin >= 1.) {
+        fr->thinTs = fr->smplWinSkip > 0;
+        fr->smplWin = capTm;
+        fr->smplWinCnt = 0;
+        fr->smplWinSkip = 0;
+    }
+    bool newMin = (rtt <= fr->min);
+    bool keep = newMin || (fr->matches % sampleEvery) == 0;
+    fr->matches++;
+    if (keep && sampleRate > 0 && fr->smplWinCnt >= uint32_t(sampleRate) &&
+        !newMin) {
+        keep = false;
+    }
+    if (!keep) {
+        fr->smplWinSkip++;
+    } else if (sampleDelta > 0. && !newMin &&
+               rtt - fr->min <= fr->min * sampleDelta) {
+        keep = false;   // (not a reason to thin: it didn't use up the budget)
+    }
+    if (keep) {
+        fr->smplWinCnt++;
+    } else {
+        sampledOut++;
+    }
+    return keep;
+}
+
+// End a --flowStats interval: snapshot the stats of the flows that had
+// RTTs in it for the scrapes to render, and start the next one
+void ppWorker::publishStats()
+{
+    for (uint32_t idx : statsFlows_) {
+        flowRec& fr = flows.at(idx);
+        const rttStats& st = fr.stats;
+        if (st.count() == 0) {
+            continue;
+        }
+        statsNext_.push_back(flowStatsRec{fr.key, st.count(), st.srtt(),
+                                          st.stddev(), st.min(), st.max(),
+                                          st.p50(), st.p95()});
+        fr.stats.endWindow();
+    }
+    statsFlows_.clear();
+    {
+        std::lock_guard<std::mutex> lk(statsMtx_);
+        statsPub_.swap(statsNext_);
+    }
+    statsNext_.clear();
+}
+
+void ppWorker::snapshot(std::vector<flowSnapRec>& out)
+{
+    for (uint32_t i = 0; i < flows.capacity(); i++) {
+        const flowRec& fr = flows.at(i);
+        if ((flows.gen(i) & 1) == 0 || !fr.revFlow) {
+            continue;   // (unused, or can't give RTTs anyway)
+        }
+        flowSnapRec r{};
+        memcpy(r.src, fr.key.src, sizeof(r.src));
+        memcpy(r.dst, fr.key.dst, sizeof(r.dst));
+        r.sport = fr.key.sport;
+        r.dport = fr.key.dport;
+        r.lastNs = offTm * 1000000000 + llround(fr.last_tm * 1e9);
+        r.min = fr.min;
+        r.bytesSnt = fr.bytesSnt;
+        r.lstBytesSnt = fr.lstBytesSnt;
+        r.bytesDep = fr.bytesDep;
+        out.push_back(r);
+    }
+}
+
+// Copy the flows for the snapshot writer (see saveSnapshot())
+void ppWorker::publishSnapshot()
+{
+    snapNext_.clear();
+    snapshot(snapNext_);
+    std::lock_guard<std::mutex> lk(snapMtx_);
+    snapPub_.swap(snapNext_);
+}
+
+// Add flow 'key' of a snapshot, last seen at 'lastTm' (see
+// loadSnapshot()); false if it's already there or the table is full.
+// If its reverse is already restored, the two are linked again.
+bool ppWorker::restoreFlow(const flowKey& key, const flowSnapRec& r,
+                           double lastTm)
+{
+    if (flows.find(key) != nullptr) {
+        return false;
+    }
+    flowRec* fr = flows.insert(key);
+    if (fr == nullptr) {
+        return false;
+    }
+    fr->last_tm = lastTm;
+    fr->min = r.min;
+    fr->bytesSnt = r.bytesSnt;
+    fr->lstBytesSnt = r.lstBytesSnt;
+    fr->bytesDep = r.bytesDep;
+    fr->revFlow = true;
+    flowCnt++;
+    uint32_t idx = flows.indexOf(fr);
+    flowWheel.schedule(flowTick{idx, flows.gen(idx)}, lastTm + flowMaxIdle);
+
+    flowRec* rr = flows.find(key.reversed());
+    if (rr != nullptr && rr->rev == NO_FLOW) {
+        fr->id = rr->id ^ 1;
+        rr->rev = idx;
+        fr->rev = flows.indexOf(rr);
+    } else {
+        fr->id = nxtFlowId;
+        nxtFlowId += 2;
     }
+    return true;
 }
 
-static std::string fmtTimeDiff(double dt)
+// Formats time difference 'dt' into 'out' (room for at least 10 bytes)
+// and returns its length
+static size_t fmtTimeDiff(double dt, char* out)
 {
     const char* SIprefix = "";
     if (dt < 1e-3) {
@@ -213,98 +1108,344 @@ static std::string fmtTimeDiff(double dt)
     } else {
         fmt = " %.0lf%ss";
     }
-    char buf[10];
-    snprintf(buf, sizeof(buf), fmt, dt, SIprefix);
-    return buf;
+    int n = snprintf(out, 10, fmt, dt, SIprefix);
+    return std::min(n, 9);
 }
 
-static bool ipRangesContains(const vector<IPv4Range>& ranges, const IPv4Address& addr) {
-    for (auto range: ranges) {
-        if (range.contains(addr)) {
-            return true;
-        }
-    }
+// Returns the label values corresponding to the Summary metric labels
+// (srcIP, dstIP, dstPort) of a flow, given its srcIP label value
+static vector<std::string> flowLabels(const flowKey& k, const std::string& src)
+{
+    return {src, addrToString(k.dst, k.isV4()), std::to_string(k.dport)};
+}
 
-    return false;
+// sum of a per-worker counter over all workers
+static int64_t total(counter ppWorker::* c)
+{
+    int64_t n = 0;
+    for (const auto& w : workers) {
+        n += ((*w).*c).get();
+    }
+    return n;
 }
 
-static void process_packet(const Packet& pkt)
+// Hand an RTT sample of flow 'key' to the output writer, through its
+// queue 'q'. 'capNs' is the capture time, in ns relative to offTm.
+static void emitSample(size_t q, const flowKey& key, int64_t capNs,
+                       double rtt, double min, double fBytes, double dBytes,
+                       double pBytes)
 {
-    u_int32_t rcv_tsval = 0, rcv_tsecr = 0;
-    std::string srcstr, dststr, ipsstr, ipdstr;
+    sampleRecord r;
+    memcpy(r.src, key.src, sizeof(r.src));
+    memcpy(r.dst, key.dst, sizeof(r.dst));
+    r.sport = key.sport;
+    r.dport = key.dport;
+    r.reserved = 0;
+    r.tsNs = offTm * 1000000000 + capNs;
+    r.rttNs = llround(rtt * 1e9);
+    r.minNs = llround(min * 1e9);
+    r.fBytes = uint64_t(fBytes);
+    r.dBytes = uint64_t(dBytes);
+    r.pBytes = uint64_t(pBytes);
+    sampleOut->write(q, r);
+}
 
-    pktCnt++;
-    // all packets should be TCP since that's in config
-    const TCP* t_tcp;
-    if ((t_tcp = pkt.pdu()->find_pdu<TCP>()) == nullptr) {
-        not_tcp++;
-        return;
+// The output formats (sampleFormatters), run on the writer thread
+
+// srcIP:port+dstIP:port
+static size_t fmtFlow(const sampleRecord& r, char* out)
+{
+    bool v4 = isV4Mapped(r.src);
+    char s[INET6_ADDRSTRLEN], d[INET6_ADDRSTRLEN];
+    inet_ntop(v4 ? AF_INET : AF_INET6, v4 ? r.src + 12 : r.src, s, sizeof(s));
+    inet_ntop(v4 ? AF_INET : AF_INET6, v4 ? r.dst + 12 : r.dst, d, sizeof(d));
+    return sprintf(out, "%s:%u+%s:%u", s, r.sport, d, r.dport);
+}
+
+// Samples come in capture time order, so the "HH:MM:SS" is only
+// worked out (by localtime_r(), which takes the libc time zone lock)
+// when the second changes. Only called on the writer thread.
+static size_t fmtHuman(const sampleRecord& r, char* out)
+{
+    static int64_t tmSec = INT64_MIN;
+    static char tmStr[16];
+    static size_t tmLen;
+    int64_t sec = r.tsNs / 1000000000;
+    if (sec != tmSec) {
+        std::time_t result = sec;
+        struct tm tmv;
+        tmLen = strftime(tmStr, sizeof(tmStr), "%T", localtime_r(&result, &tmv));
+        tmSec = sec;
     }
-    try {
-        std::pair<uint32_t, uint32_t> tts = t_tcp->timestamp();
-        rcv_tsval = tts.first;
-        rcv_tsecr = tts.second;
-    } catch (std::exception&) {
-        no_TS++;
-        return;
+    memcpy(out, tmStr, tmLen);
+    size_t n = tmLen;
+    out[n++] = ' ';
+    n += fmtTimeDiff(r.rttNs * 1e-9, out + n);
+    out[n++] = ' ';
+    n += fmtTimeDiff(r.minNs * 1e-9, out + n);
+    out[n++] = ' ';
+#ifdef notyet
+    n += sprintf(out + n, "%d ", int(r.fBytes - r.dBytes));
+#endif
+    n += fmtFlow(r, out + n);
+    out[n++] = '\n';
+    return n;
+}
+
+static size_t fmtMachine(const sampleRecord& r, char* out)
+{
+    size_t n = sprintf(out, "%" PRId64 ".%06d %.6f %.6f %" PRIu64 " %" PRIu64
+                       " %" PRIu64 " ", r.tsNs / 1000000000,
+                       int(r.tsNs % 1000000000 / 1000), r.rttNs * 1e-9,
+                       r.minNs * 1e-9, r.fBytes, r.dBytes, r.pBytes);
+    n += fmtFlow(r, out + n);
+    out[n++] = '\n';
+    return n;
+}
+
+#define CSV_HEADER "time,rtt,minrtt,fbytes,dbytes,pbytes,srcIP,srcPort,dstIP,dstPort\n"
+
+static size_t fmtCsv(const sampleRecord& r, char* out)
+{
+    bool v4 = isV4Mapped(r.src);
+    char s[INET6_ADDRSTRLEN], d[INET6_ADDRSTRLEN];
+    inet_ntop(v4 ? AF_INET : AF_INET6, v4 ? r.src + 12 : r.src, s, sizeof(s));
+    inet_ntop(v4 ? AF_INET : AF_INET6, v4 ? r.dst + 12 : r.dst, d, sizeof(d));
+    return sprintf(out, "%" PRId64 ".%06d,%.6f,%.6f,%" PRIu64 ",%" PRIu64 ",%"
+                   PRIu64 ",%s,%u,%s,%u\n", r.tsNs / 1000000000,
+                   int(r.tsNs % 1000000000 / 1000), r.rttNs * 1e-9,
+                   r.minNs * 1e-9, r.fBytes, r.dBytes, r.pBytes, s, r.sport,
+                   d, r.dport);
+}
+
+static size_t fmtBinary(const sampleRecord& r, char* out)
+{
+    memcpy(out, &r, sizeof(r));
+    return sizeof(r);
+}
+
+// The rendered Prometheus labels of a flow's RTT series
+static std::string rttLabels(const flowKey& k, const std::string& src)
+{
+    static const vector<std::string> names = {"srcIP", "dstIP", "dstPort"};
+    return promLabels(names, flowLabels(k, src));
+}
+
+static void rankSamples(seriesRef& ref)
+{
+    if (ref.unranked > 0) {
+        srcLabels.count(ref.src, ref.unranked);
+        ref.unranked = 0;
     }
-    if (rcv_tsval == 0 || (rcv_tsecr == 0 && (t_tcp->flags() != TCP::SYN))) {
-        return;
+}
+
+// Add an RTT sample of flow 'key' to its series in 'shard'. The labels
+// are resolved on the flow's first sample; after that only a change in
+// the top-K sources makes them be looked at again.
+static void observeRtt(metricShard& shard, seriesRef& ref, const flowKey& key,
+                       double rtt)
+{
+    if (!ref.series) {
+        ref.src = srcLabels.srcLabel(key.src, key.isV4());
+    }
+    if (srcLabels.ranked()) {
+        // samples are counted towards the ranking in batches
+        if (++ref.unranked >= 64 || !ref.series) {
+            rankSamples(ref);
+        }
+        uint32_t gen = srcLabels.generation();
+        if (!ref.series || gen != ref.gen) {
+            ref.gen = gen;
+            std::string lbl = rttLabels(key, srcLabels.topOrOther(ref.src));
+            if (!ref.series || lbl != ref.series->labels) {
+                if (ref.series) {
+                    shard.release(ref.series);
+                }
+                ref.series = shard.acquire(lbl);
+            }
+        }
+    } else if (!ref.series) {
+        ref.series = shard.acquire(rttLabels(key, ref.src));
     }
+    ref.series->observe(rtt * 1000);    // s to ms
+}
 
-    const IP* ip;
-    const IPv6* ipv6;
-    if ((ip = pkt.pdu()->find_pdu<IP>()) != nullptr) {
-        ipsstr = ip->src_addr().to_string();
-        ipdstr = ip->dst_addr().to_string();
-    } else if ((ipv6 = pkt.pdu()->find_pdu<IPv6>()) != nullptr) {
-        ipsstr = ipv6->src_addr().to_string();
-        ipdstr = ipv6->dst_addr().to_string();
-    } else {
-        not_v4or6++;
-        return;
+// Drop a flow's series handle (the series is deleted once no flow uses it)
+static void releaseSeries(metricShard& shard, seriesRef& ref)
+{
+    if (ref.series) {
+        rankSamples(ref);
+        shard.release(ref.series);
+        ref.series = nullptr;
     }
-    // Reach here with a TCP packet with timestamp option
-    srcstr = ipsstr + ":" + std::to_string(t_tcp->sport());
-    dststr = ipdstr + ":" + std::to_string(t_tcp->dport());
-    // process capture clock time
-    std::time_t result = pkt.timestamp().seconds();
-    if (offTm < 0) {
-        offTm = static_cast<int64_t>(pkt.timestamp().seconds());
-        // fractional part of first usable packet time
-        startm = double(pkt.timestamp().microseconds()) * 1e-6;
-        capTm = startm;
-        if (sumInt) {
-            std::cerr << "First packet at "
-                      << std::asctime(std::localtime(&result)) << "\n";
+}
+
+// An RTT for a flow's Prometheus series, or the flow going away. Flows
+// are known by their worker (queue) and flowTable index.
+struct metricEvent
+{
+    flowKey key;
+    uint32_t slot;
+    double rtt;         // s; < 0: the flow was deleted
+};
+
+// The workers' Prometheus updates are made by this thread: they hand
+// over metricEvents through one SPSC queue each, and it drains them in
+// batches, so series lookups, the locks they take (against scrapes and
+// the top-K source ranking) and label strings are all off the packet
+// path. It's the only writer of the RTT series (rttMetric shard 'q' has
+// worker q's flows; in eBPF mode the workers are idle and the capture
+// thread observes into shard 0 itself). If a queue is full the RTT is
+// dropped (and counted by the worker) rather than hold up the worker;
+// deletions always wait.
+class metricUpdater
+{
+  public:
+    metricUpdater(metricFamily& family, size_t nWorkers, size_t flowsPerWorker)
+        : family_(family)
+    {
+        for (size_t i = 0; i < nWorkers; i++) {
+            queues_.emplace_back(new spscRing<metricEvent>(1 << 15));
+            refs_.emplace_back(flowsPerWorker);
         }
-    } else {
-        // offset capture time
-        int64_t tt = static_cast<int64_t>(pkt.timestamp().seconds()) - offTm;
-        capTm = double(tt) + double(pkt.timestamp().microseconds()) * 1e-6;
+    }
+    ~metricUpdater() { stop(); }
+
+    void start() { thread_ = std::thread(&metricUpdater::run, this); }
+
+    // apply everything queued so far and stop the thread
+    void stop()
+    {
+        if (thread_.joinable()) {
+            done_.store(true, std::memory_order_release);
+            thread_.join();
+        }
+    }
+
+    // from worker 'q': false if the RTT couldn't be queued
+    bool observe(size_t q, uint32_t slot, const flowKey& key, double rtt)
+    {
+        return queues_[q]->push(metricEvent{key, slot, rtt});
+    }
+
+    void release(size_t q, uint32_t slot)
+    {
+        while (!queues_[q]->push(metricEvent{flowKey(), slot, -1.})) {
+            std::this_thread::yield();
+        }
+    }
+
+  private:
+    void run()
+    {
+        metricEvent batch[256];
+        for (;;) {
+            // (as sampleWriter::run())
+            bool done = done_.load(std::memory_order_acquire);
+            size_t got = 0;
+            for (size_t q = 0; q < queues_.size(); q++) {
+                size_t n = queues_[q]->pop(batch, 256);
+                for (size_t i = 0; i < n; i++) {
+                    const metricEvent& ev = batch[i];
+                    if (ev.rtt < 0.) {
+                        releaseSeries(family_.shard(q), refs_[q][ev.slot]);
+                    } else {
+                        observeRtt(family_.shard(q), refs_[q][ev.slot],
+                                   ev.key, ev.rtt);
+                    }
+                }
+                got += n;
+            }
+            if (got == 0) {
+                if (done) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    metricFamily& family_;
+    std::vector<std::unique_ptr<spscRing<metricEvent>>> queues_;
+    std::vector<std::vector<seriesRef>> refs_;  // [worker][flowTable index]
+    std::atomic<bool> done_{false};
+    std::thread thread_;
+};
+
+static metricUpdater* metricsOut;   // (created in main())
+
+void ppWorker::processPkt(const pktInfo& pi)
+{
+    const flowKey& key = pi.key;
+    // (integer ns for RTTs; seconds will do for everything else)
+    double capTm = double(pi.capNs) * 1e-9;
+
+    // Table maintenance runs inline, driven by packet capture time, so
+    // the tables are only ever touched by this worker's thread and file
+    // input ages the same however fast it's read. The expiry wheels
+    // make each pass cost only what comes due, so it is run every wheel
+    // tick. (Live input sends clock ticks while it's idle, see
+    // idleTick(), so flows and their series still go away.)
+    if (capTm >= nxtClean) {
+        cleanUp(capTm);     // get rid of stale entries
+        nxtClean = capTm + std::max(tsvalMaxAge, 1e-3) / (WHEEL_BUCKETS / 2);
+    }
+    if (statsInt > 0. && capTm >= nxtStats_) {
+        publishStats();
+        nxtStats_ = capTm + statsInt;
+    }
+    if (!snapFile.empty() && capTm >= nxtSnap_) {
+        publishSnapshot();
+        nxtSnap_ = capTm + snapInt;
+    }
+    if (admit_ && capTm >= nxtAdmitReset_) {
+        admit_->clear();
+        nxtAdmitReset_ = capTm + ADMIT_RESET;
+    }
+    if (pi.size == 0) {
+        return;
     }
 
-    std::string fstr = srcstr + "+" + dststr;  // could add DSCP field to key
     // Creates a flowRec entry whenever needed
-    flowRec* fr;
-    if (flows.count(fstr) == 0u) {
-        if (flowCnt > maxFlows) {
-            // stop adding flows till something goes away
-            return;
+    flowRec* fr = flows.find(key);
+    if (fr == nullptr) {
+        flowRec* rr = flows.find(key.reversed());
+        if (rr == nullptr && admit_) {
+            // not until both directions have been seen, then both get
+            // a record at once
+            if (!admit_->see(key)) {
+                uniDir++;
+                return;
+            }
+            rr = newFlow(key.reversed(), capTm, nullptr);
+            if (rr == nullptr) {
+                return;
+            }
+            rr->id = nxtFlowId;
+            nxtFlowId += 2;
+        }
+        fr = newFlow(key, capTm, rr);
+        if (fr == nullptr) {
+            return;     // (a one record table)
         }
-        fr = new flowRec(fstr);
-        flowCnt++;
-        flows.emplace(fstr, fr);
 
         // only want to record tsvals when capturing both directions
         // of a flow. if this flow is the reverse of a known flow,
-        // mark both as bi-directional.
-        if (flows.count(dststr + "+" + srcstr) != 0u) {
-            flows.at(dststr + "+" + srcstr)->revFlow = true;
+        // mark both as bi-directional and link them. The two
+        // directions share a flow-id pair, differing only in the low
+        // bit.
+        if (rr != nullptr) {
+            fr->id = rr->id ^ 1;
+            rr->revFlow = true;
             fr->revFlow = true;
+            rr->rev = flows.indexOf(fr);
+            fr->rev = flows.indexOf(rr);
+        } else {
+            fr->id = nxtFlowId;
+            nxtFlowId += 2;
         }
     } else {
-        fr = flows.at(fstr);
+        fr->ref = true;
     }
     fr->last_tm = capTm;
 
@@ -313,136 +1454,803 @@ static void process_packet(const Packet& pkt)
         return;
     }
 
-    double arr_fwd = fr->bytesSnt + pkt.pdu()->size();
+    double arr_fwd = fr->bytesSnt + pi.size;
     fr->bytesSnt = arr_fwd;
-    if (!filtLocal || !ipRangesContains(localRanges, ipdstr)) {
-        addTS(fstr + "+" + std::to_string(rcv_tsval),
-              new tsInfo(capTm, arr_fwd, fr->bytesDep));
+    // Only the first packet with a TSval is recorded, so the rest of a
+    // run of them needn't go near the table. Flows that are being
+    // sampled only record 1 in TS_THIN TSvals: most of their matches
+    // would be skipped anyway.
+    if (pi.tsval != fr->lastTsval) {
+        fr->lastTsval = pi.tsval;
+        if ((!fr->thinTs || fr->nTsvals++ % TS_THIN == 0) &&
+            (!filtLocal || !localNets.contains(key.dst, key.isV4()))) {
+            addTS(tsKey{fr->id, pi.tsval},
+                  tsInfo{tsInfo::stamp(pi.capNs), pi.seqEnd, arr_fwd,
+                         fr->bytesDep},
+                  capTm);
+        }
     }
-    tsInfo* ti = getTStm(dststr + "+" + srcstr + "+" +
-                         std::to_string(rcv_tsecr));
-    if (ti && ti->t > 0.0) {
+    tsInfo* ti = getTStm(tsKey{fr->id ^ 1, pi.ecr});
+    // (with --seqMatch, only once the ACK covers the TSval's first packet:
+    // an ACK of earlier data may echo the TSval too, but it didn't wait
+    // for that packet so the RTT would be too long)
+    if (ti && !ti->used() && ti->age(pi.capNs) >= 0 &&
+        (!seqMatch || int32_t(pi.ack - ti->seqEnd) >= 0)) {
         // this packet is the return "pping" --
         // process it for packet's src
-        double t = ti->t;
-        double rtt = capTm - t; // RTT of src to capture point
+        double rtt = double(ti->age(pi.capNs)) * 1e-9; // RTT of src to capture point
+        if (statsInt > 0.) {
+            if (fr->stats.count() == 0) {
+                statsFlows_.push_back(flows.indexOf(fr));
+            }
+            fr->stats.add(rtt);
+        }
+        bool keep = keepSample(fr, rtt, capTm);
         if (fr->min > rtt) {
             fr->min = rtt;       //track minimum
         }
         double fBytes = ti->fBytes;
         double dBytes = ti->dBytes;
+        if (fr->rev != NO_FLOW) {
+            flows.at(fr->rev).bytesDep = fBytes;
+        }
+        ti->markUsed(); //leaves an entry in the TS table to avoid saving this
+                        // TSval again, marked to indicate it's been used
+        if (!keep) {
+            return;
+        }
         double pBytes = arr_fwd - fr->lstBytesSnt;
         fr->lstBytesSnt = arr_fwd;
-        flows.at(dststr + "+" + srcstr)->bytesDep = fBytes;
 
-        if (machineReadable) {
-            printf("%" PRId64 ".%06d %.6f %.6f %.0f %.0f %.0f",
-                    int64_t(capTm + offTm), int((capTm - floor(capTm)) * 1e6),
-                    rtt, fr->min, fBytes, dBytes, pBytes);
+        emitSample(outQ_, key, pi.capNs, rtt, fr->min, fBytes, dBytes, pBytes);
+        samples++;
+
+        // Update Prometheus Summary / Histogram
+        if (metricsOut->observe(outQ_, flows.indexOf(fr), key, rtt)) {
+            fr->exported = true;
         } else {
-            char tbuff[80];
-            struct tm* ptm = std::localtime(&result);
-            strftime(tbuff, 80, "%T", ptm);
-#ifdef notyet
-            printf("%s %s %s %d", tbuff, fmtTimeDiff(rtt).c_str(),
-                   fmtTimeDiff(fr->min).c_str(), (int)(fBytes - dBytes));
-#else
-            printf("%s %s %s", tbuff, fmtTimeDiff(rtt).c_str(),
-                   fmtTimeDiff(fr->min).c_str());
-#endif
+            metricsDropped++;
+        }
+    }
+}
+
+// A record for new flow 'key'. When the table is full, one is evicted
+// (never 'keep', the reverse flow being linked to it) for it; nullptr
+// if there's none to evict.
+flowRec* ppWorker::newFlow(const flowKey& key, double capTm, const flowRec* keep)
+{
+    flowRec* fr = flows.insert(key);
+    if (fr == nullptr) {
+        flowRec* v = flows.victim(keep);
+        if (v == nullptr) {
+            return nullptr;
+        }
+        removeFlow(v);
+        flowsEvicted++;
+        fr = flows.insert(key);
+    }
+    fr->last_tm = capTm;
+    flowCnt++;
+    uint32_t idx = flows.indexOf(fr);
+    flowWheel.schedule(flowTick{idx, flows.gen(idx)}, capTm + flowMaxIdle);
+    return fr;
+}
+
+void ppWorker::removeFlow(flowRec* fr)
+{
+    if (fr->exported) {
+        metricsOut->release(outQ_, flows.indexOf(fr));
+    }
+    if (fr->rev != NO_FLOW) {
+        flows.at(fr->rev).rev = NO_FLOW;
+    }
+    flows.erase(fr);
+    flowCnt--;
+}
+
+void ppWorker::cleanUp(double n)
+{
+    auto t0 = std::chrono::steady_clock::now();
+
+    // erase entry if its TSval was seen more than tsvalMaxAge
+    // seconds in the past. (The wheel may come to it up to a tick early;
+    // it's then filed again.) After a long enough gap every entry is
+    // older than that, though its age may have wrapped (see tsInfo).
+    bool gap = n - tsCleaned_ > TS_WRAP / 2;
+    tsCleaned_ = n;
+    int64_t nNs = llround(n * 1e9);
+    tsWheel.advance(n, [this, n, nNs, gap](const tsKey& key) {
+        const tsInfo* ti = tsTbl.find(key);
+        if (ti == nullptr) {
+            return;
         }
+        double age = double(ti->age(nNs)) * 1e-9;
+        if (gap || age > tsvalMaxAge) {
+            tsTbl.erase(key);
+            tsCnt--;
+        } else {
+            tsWheel.schedule(key, n - age + tsvalMaxAge);
+        }
+    });
 
-        printf(" %s\n", fstr.c_str());
-        ti->t = -t;     //leaves an entry in the TS table to avoid saving this
-                        // TSval again, mark it negative to indicate it's been used
+    flowWheel.advance(n, [this, n](const flowTick& t) {
+        if (flows.gen(t.idx) != t.gen) {
+            return;     // (evicted)
+        }
+        flowRec* fr = &flows.at(t.idx);
+        if (n - fr->last_tm > flowMaxIdle) {
+            removeFlow(fr);
+        } else {
+            flowWheel.schedule(t, fr->last_tm + flowMaxIdle);
+        }
+    });
+    cleanNs.add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - t0).count());
+}
+
+// Process a burst of packets, loading the table lines each will need
+// first: the flow index slots, then the flow records, then the TSval
+// slots its TSval and ECR go in, so the misses on large tables overlap
+// rather than each stalling its packet. (The lookups are simply redone
+// by process(); all but the hashing then hit the cache.)
+void ppWorker::processBurst(const pktInfo* p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        flows.prefetchSlot(p[i].key);
+    }
+    for (size_t i = 0; i < n; i++) {
+        flows.prefetchRecord(p[i].key);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (const flowRec* fr = flows.find(p[i].key)) {
+            tsTbl.prefetch(tsKey{fr->id, p[i].tsval});
+            tsTbl.prefetch(tsKey{fr->id ^ 1, p[i].ecr});
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        process(p[i]);
+    }
+}
+
+void ppWorker::run()
+{
+    pktInfo batch[BURST];
+    for (;;) {
+        // everything was pushed before captureDone was set so once it's
+        // seen, an empty ring means there's nothing more to come
+        bool done = captureDone.load(std::memory_order_acquire);
+        size_t n = ring->pop(batch, BURST);
+        processBurst(batch, n);
+        if (n == 0) {
+            if (done) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+    }
+}
+
+// the worker that owns flow 'k' (and its reverse)
+static inline size_t shardOf(const flowKey& k)
+{
+    return (uint32_t(shardHash(k)) * uint64_t(workers.size())) >> 32;
+}
+
+// hand a parsed packet to the worker that owns its flow
+static inline void dispatch(const pktInfo& pi)
+{
+    if (workers.size() == 1) {
+        workers[0]->process(pi);
+        return;
+    }
+    size_t w = shardOf(pi.key);
+    while (!workers[w]->ring->push(pi)) {
+        std::this_thread::yield();  // worker is behind; don't lose packets
+    }
+}
+
+// hand a burst of parsed packets to their workers
+static void dispatchBurst(const pktInfo* p, size_t n)
+{
+    if (workers.size() == 1) {
+        workers[0]->processBurst(p, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        dispatch(p[i]);
+    }
+}
+
+static double clockSecs(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+}
+
+static int64_t clockNs(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// With live input, tell the workers the time when no packet has been
+// captured for a second, so idle flows and TSvals still age out. (File
+// input is aged by capture time alone.)
+static void idleTick()
+{
+    if (offTm < 0) {
+        return;
+    }
+    double now = clockSecs(CLOCK_REALTIME) - double(offTm);
+    if (now - capTm < 1.) {
+        return;
+    }
+    capTm = now;
+    pktInfo pi{};
+    pi.capNs = llround(now * 1e9);
+    for (auto& w : workers) {
+        if (workers.size() == 1) {
+            w->process(pi);
+        } else {
+            while (!w->ring->push(pi)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+}
+
+// The sequence number just past a segment with 'len' bytes of data and
+// TCP flags 'flags' (a SYN and a FIN each take one)
+static inline uint32_t seqEnd(uint32_t seq, uint32_t len, uint16_t flags)
+{
+    return seq + len + ((flags & TCP::SYN) ? 1 : 0) + ((flags & TCP::FIN) ? 1 : 0);
+}
+
+// Set the capture time of a parsed packet (the first packet seen sets
+// the time origin)
+static void setCapTm(pktInfo& pi, int64_t tsec, int64_t tnsec)
+{
+    // process capture clock time
+    std::time_t result = tsec;
+    if (offTm < 0) {
+        offTm = tsec;
+        // fractional part of first usable packet time
+        startm = double(tnsec) * 1e-9;
+        if (sumInt) {
+            std::cerr << "First packet at "
+                      << std::asctime(std::localtime(&result)) << "\n";
+        }
+    }
+    // offset capture time
+    pi.capNs = (tsec - offTm) * 1000000000 + tnsec;
+    capTm = double(pi.capNs) * 1e-9;
+}
+
+// set a parsed packet's capture time and pass it on to its worker
+static void submit(pktInfo& pi, int64_t tsec, int64_t tnsec)
+{
+    setCapTm(pi, tsec, tnsec);
+    dispatch(pi);
+}
+
+// Parse a captured packet on the capture thread with libtins and pass it
+// on to its worker if it's a TCP packet with a usable timestamp option.
+// 'tsec' and 'tnsec' are its capture time. This is the slow path, for
+// frames process_frame() can't parse itself.
+static void process_packet(const PDU& pdu, int64_t tsec, int64_t tnsec)
+{
+    u_int32_t rcv_tsval = 0, rcv_tsecr = 0;
+    pktInfo pi;
+    flowKey& key = pi.key;
+
+    pktCnt++;
+    // all packets should be TCP since that's in config
+    const TCP* t_tcp;
+    if ((t_tcp = pdu.find_pdu<TCP>()) == nullptr) {
+        not_tcp++;
+        return;
+    }
+    try {
+        std::pair<uint32_t, uint32_t> tts = t_tcp->timestamp();
+        rcv_tsval = tts.first;
+        rcv_tsecr = tts.second;
+    } catch (std::exception&) {
+        no_TS++;
+        return;
+    }
+    if (rcv_tsval == 0 || (rcv_tsecr == 0 && (t_tcp->flags() != TCP::SYN))) {
+        return;
+    }
+
+    const IP* ip;
+    const IPv6* ipv6;
+    uint32_t segLen;    // TCP header and data, as the IP header has it
+    if ((ip = pdu.find_pdu<IP>()) != nullptr) {
+        setV4Addr(key.src, ip->src_addr());
+        setV4Addr(key.dst, ip->dst_addr());
+        segLen = ip->tot_len() - ip->header_size();
+    } else if ((ipv6 = pdu.find_pdu<IPv6>()) != nullptr) {
+        IPv6Address sa = ipv6->src_addr(), da = ipv6->dst_addr();
+        std::copy(sa.begin(), sa.end(), key.src);
+        std::copy(da.begin(), da.end(), key.dst);
+        segLen = 40 + ipv6->payload_length() - ipv6->header_size();
+    } else {
+        not_v4or6++;
+        return;
+    }
+    // Reach here with a TCP packet with timestamp option
+    key.sport = t_tcp->sport();
+    key.dport = t_tcp->dport();
+    pi.tsval = rcv_tsval;
+    pi.ecr = rcv_tsecr;
+    pi.size = pdu.size();
+    uint32_t hlen = t_tcp->header_size();
+    pi.seqEnd = seqEnd(t_tcp->seq(), segLen > hlen ? segLen - hlen : 0,
+                       t_tcp->flags());
+    pi.ack = t_tcp->ack_seq();
+    if (seqMatch && (t_tcp->flags() & TCP::ACK) == 0) {
+        pi.ecr = 0;     // (no ACK to check, so no match)
+    }
+    submit(pi, tsec, tnsec);
+}
+
+static void process_packet(const Packet& pkt)
+{
+    // (libtins timestamps are in us: see liveSniffer)
+    process_packet(*pkt.pdu(), pkt.timestamp().seconds(),
+                   pkt.timestamp().microseconds() * 1000);
+}
+
+// Frames the parser turned away, added to the counters once per burst
+struct parseTally
+{
+    int64_t pkts{}, notTcp{}, noTs{}, notV4or6{};
+
+    void flush()
+    {
+        pktCnt.add(pkts);
+        not_tcp.add(notTcp);
+        no_TS.add(noTs);
+        not_v4or6.add(notV4or6);
+        *this = parseTally();
+    }
+};
+
+enum frameResult { FRAME_SKIP, FRAME_OK, FRAME_FALLBACK };
+
+// Parse a raw frame of link type 'dlt' (one rawParseDlt() accepts) in
+// place into 'pi', with its capture time set. FRAME_SKIP if it isn't
+// one for the workers (it's counted in 't'), FRAME_FALLBACK if it has an
+// encapsulation the parser doesn't handle and needs libtins.
+static frameResult parse_frame(const uint8_t* data, uint32_t caplen, int dlt,
+                               int64_t tsec, int64_t tnsec, pktInfo& pi,
+                               parseTally& t)
+{
+    tcpTsFields tf;
+    switch (parseTcpTs(data, caplen, dlt, tf)) {
+    case PARSE_OK:
+        break;
+    case PARSE_FALLBACK:
+        return FRAME_FALLBACK;
+    case PARSE_NOT_TCP:
+        t.pkts++;
+        t.notTcp++;
+        return FRAME_SKIP;
+    case PARSE_NO_TS:
+        t.pkts++;
+        t.noTs++;
+        return FRAME_SKIP;
+    case PARSE_NOT_V4_OR_6:
+        t.pkts++;
+        t.notV4or6++;
+        return FRAME_SKIP;
+    }
+
+    t.pkts++;
+    if (tf.tsval == 0 || (tf.ecr == 0 && tf.flags != TCP::SYN)) {
+        return FRAME_SKIP;
+    }
+    if (tf.v6) {
+        memcpy(pi.key.src, tf.src, 16);
+        memcpy(pi.key.dst, tf.dst, 16);
+    } else {
+        uint32_t a;
+        memcpy(&a, tf.src, 4);
+        setV4Addr(pi.key.src, a);
+        memcpy(&a, tf.dst, 4);
+        setV4Addr(pi.key.dst, a);
+    }
+    pi.key.sport = tf.sport;
+    pi.key.dport = tf.dport;
+    pi.tsval = tf.tsval;
+    pi.ecr = tf.ecr;
+    pi.size = tf.wireLen;
+    pi.seqEnd = seqEnd(tf.seq, tf.dataLen, tf.flags);
+    pi.ack = tf.ack;
+    if (seqMatch && (tf.flags & TCP::ACK) == 0) {
+        pi.ecr = 0;     // (no ACK to check, so no match)
+    }
+    setCapTm(pi, tsec, tnsec);
+    return FRAME_OK;
+}
+
+// a frame parse_frame() couldn't handle, through libtins
+static void fallback_frame(const uint8_t* data, uint32_t caplen, int dlt,
+                           int64_t tsec, int64_t tnsec)
+{
+    try {
+        if (dlt == DLT_LINUX_SLL) {
+            process_packet(SLL(data, caplen), tsec, tnsec);
+        } else {
+            process_packet(EthernetII(data, caplen), tsec, tnsec);
+        }
+    } catch (malformed_packet&) {
+        pktCnt++;
+        not_tcp++;
+    }
+}
+
+// Parse a raw frame (see parse_frame()) and pass it on
+static void process_frame(const uint8_t* data, uint32_t caplen, int dlt,
+                          int64_t tsec, int64_t tnsec)
+{
+    pktInfo pi;
+    parseTally t;
+    frameResult r = parse_frame(data, caplen, dlt, tsec, tnsec, pi, t);
+    t.flush();
+    if (r == FRAME_OK) {
+        dispatch(pi);
+    } else if (r == FRAME_FALLBACK) {
+        fallback_frame(data, caplen, dlt, tsec, tnsec);
+    }
+}
+
+// One of a burst of raw frames for process_burst()
+struct burstFrame
+{
+    const uint8_t* data;
+    uint32_t caplen;
+    int dlt;
+    int64_t sec;
+    int64_t nsec;
+};
+
+// How many frames the next burst may have: fewer than BURST if that
+// would go past -c
+static size_t burstMax()
+{
+    if (maxPackets <= 0) {
+        return BURST;
+    }
+    return size_t(std::max<int64_t>(1, std::min<int64_t>(BURST,
+                                    maxPackets - pktCnt.get())));
+}
+
+// Parse a burst of (up to BURST) frames, as they come from a ring block
+// or a mapped file, and pass the packets for the workers on together:
+// the counters are updated once, and a single worker gets them as a
+// burst to prefetch for (see ppWorker::processBurst()). The parse is
+// scalar: the headers' offsets depend on each other, so there is
+// nothing for a SIMD gather to do that the per-frame loads (from lines
+// already being read) don't.
+static void process_burst(const burstFrame* f, size_t n)
+{
+    pktInfo pis[BURST];
+    size_t m = 0;
+    parseTally t;
+    for (size_t i = 0; i < n; i++) {
+        switch (parse_frame(f[i].data, f[i].caplen, f[i].dlt, f[i].sec,
+                            f[i].nsec, pis[m], t)) {
+        case FRAME_OK:
+            m++;
+            break;
+        case FRAME_FALLBACK:
+            // (keeping the packets in order)
+            dispatchBurst(pis, m);
+            m = 0;
+            fallback_frame(f[i].data, f[i].caplen, f[i].dlt, f[i].sec,
+                           f[i].nsec);
+            break;
+        case FRAME_SKIP:
+            break;
+        }
+    }
+    t.flush();
+    dispatchBurst(pis, m);
+}
 
-        // Update Prometheus Summary
-        vector<std::string> labelVals = {ipsstr, ipdstr, std::to_string(t_tcp->dport())};
-        flowSummaryVec.WithLabelValues(labelVals).Observe(rtt * 1000); // s to ms
+// frames from the AF_PACKET ring
+static void process_burst(const frameSpan* f, size_t n)
+{
+    burstFrame b[BURST];
+    for (size_t i = 0; i < n; i++) {
+        b[i] = burstFrame{f[i].data, f[i].caplen, DLT_EN10MB, f[i].sec,
+                          f[i].nsec};
     }
+    process_burst(b, n);
 }
 
-// Takes a flow record string (srcIP:srcPort+dstIP:dstPort) and parses it to
-// return a vector of label values corresponding to the Summary metric labels
-inline vector<std::string> parseLabels(const std::string& flowStr) {
-    std::string srcIP = flowStr.substr(0, flowStr.find(':'));
+// add all the IPv4 and IPv6 addresses of 'ifname' to 'nets'; returns
+// how many there were
+static int localAddrsOf(const std::string& ifname, prefixSet& nets)
+{
+    int n = 0;
+    struct ifaddrs* ifap;
 
-    size_t sepIdx = flowStr.find('+');
-    size_t colIdx = flowStr.rfind(':');
-    std::string dstIP = flowStr.substr(sepIdx + 1, colIdx - sepIdx - 1);
-    std::string dstPort = flowStr.substr(colIdx + 1);
+    if (getifaddrs(&ifap) == 0) {
+        for (auto ifp = ifap; ifp; ifp = ifp->ifa_next) {
+            if (ifname != ifp->ifa_name || ifp->ifa_addr == nullptr) {
+                continue;
+            }
+            uint8_t a[16] = {};
+            if (ifp->ifa_addr->sa_family == AF_INET) {
+                setV4Addr(a, ((struct sockaddr_in*)
+                              ifp->ifa_addr)->sin_addr.s_addr);
+            } else if (ifp->ifa_addr->sa_family == AF_INET6) {
+                memcpy(a, &((struct sockaddr_in6*)
+                            ifp->ifa_addr)->sin6_addr, 16);
+            } else {
+                continue;
+            }
+            nets.add(a, 128);
+            n++;
+        }
+        freeifaddrs(ifap);
+    }
+    return n;
+}
 
-    return {srcIP, dstIP, dstPort};
+static inline std::string printnz(int64_t v, const char *s) {
+    return (v > 0? std::to_string(v) + s : "");
 }
 
-static void cleanUp(double n)
+// counter values as of the last summary
+static int64_t pktBase, noTsBase, notTcpBase, notV4or6Base, samplesLostBase,
+               dropsBase, filteredBase, uniDirBase, tsTblFullBase;
+
+// A live libpcap capture. Its timestamps are in ns (taken by the
+// adapter with --hwTimestamps) when the link type is one the raw parser
+// takes; otherwise the frames become libtins Packets, which only carry
+// us, so that's what they're captured with. With 'immediate', frames are
+// handed over as they arrive rather than a buffer at a time.
+class liveSniffer : public BaseSniffer
 {
-    // erase entry if its TSval was seen more than tsvalMaxAge
-    // seconds in the past.
-    for (auto it = tsTbl.begin(); it != tsTbl.end();) {
-        if (n - std::abs(it->second->t) > tsvalMaxAge) {
-            delete it->second;
-            it = tsTbl.erase(it);
-        } else {
-            ++it;
+  public:
+    // throws std::runtime_error
+    liveSniffer(const std::string& ifname, const std::string& filter, bool hwTs,
+                bool immediate = false)
+    {
+        pcap_t* p = open(ifname, hwTs, immediate, true);
+        if (!rawParseDlt(pcap_datalink(p))) {
+            pcap_close(p);
+            p = open(ifname, hwTs, immediate, false);
+        }
+        set_pcap_handle(p);
+        if (!set_filter(filter)) {
+            throw std::runtime_error("bad filter '" + filter + "'");
         }
     }
 
-    vector<std::string> labelVals;
-    for (auto it = flows.begin(); it != flows.end();) {
-        flowRec* fr = it->second;
-        if (n - fr->last_tm > flowMaxIdle) {
-            // Delete underlying Prometheus metric in Go, if it exists
-            labelVals = parseLabels(it->first);
-            flowSummaryVec.DeleteLabelValues(labelVals);
+  private:
+    static pcap_t* open(const std::string& ifname, bool hwTs, bool immediate,
+                        bool nano)
+    {
+        char err[PCAP_ERRBUF_SIZE];
+        pcap_t* p = pcap_create(ifname.c_str(), err);
+        if (p == nullptr) {
+            throw std::runtime_error(err);
+        }
+        pcap_set_snaplen(p, SNAP_LEN);
+        pcap_set_promisc(p, 0);
+        pcap_set_timeout(p, 250);
+        pcap_set_immediate_mode(p, immediate ? 1 : 0);
+        if (nano) {
+            // (if it can't, the handle stays in us)
+            pcap_set_tstamp_precision(p, PCAP_TSTAMP_PRECISION_NANO);
+        }
+        int r = hwTs ? pcap_set_tstamp_type(p, PCAP_TSTAMP_ADAPTER) : 0;
+        int a = pcap_activate(p);
+        if (a < 0) {
+            std::string e = (a == PCAP_ERROR) ? pcap_geterr(p) : pcap_statustostr(a);
+            pcap_close(p);
+            throw std::runtime_error(e);
+        }
+        if (r != 0 || a == PCAP_WARNING_TSTAMP_TYPE_NOTSUP) {
+            std::cerr << "WARNING: " << ifname << " can't timestamp frames "
+                         "itself, using the kernel's timestamps\n";
+        }
+        return p;
+    }
+};
+
+// packet source: a libtins (pcap) sniffer, an AF_PACKET ring, a -r file
+// read by capFile or, with several -r files, a pcapMerge of them
+static BaseSniffer* snif = nullptr;
+static capFile* inFile = nullptr;
+static capFilter* inFilter = nullptr;
+static pcapMerge* fileMerge = nullptr;
+static afPacketRing* afRing = nullptr;
+
+// A live capture interface (-i): its libpcap handle or AF_PACKET ring,
+// and the kernel's counts for it
+class liveIf
+{
+  public:
+    explicit liveIf(const std::string& n) : name{n} {}
+    ~liveIf()
+    {
+        delete snif;
+        delete ring;
+        delete tsFiltered;
+    }
+    liveIf(const liveIf&) = delete;
+    liveIf& operator=(const liveIf&) = delete;
+
+    std::string name;
+    liveSniffer* snif{};
+    afPacketRing* ring{};
+    afPacketCounter* tsFiltered{};  // what tsFilter drops
+    int dlt{DLT_EN10MB};
+    int64_t nsMul{1000};            // libpcap timestamp units to ns
+    counter packets;                // passed by the capture filter
+    counter drops;                  // of those, dropped by the kernel
+    unsigned prevRecv{}, prevDrops{};   // (libpcap's are cumulative)
+};
 
-            delete it->second;
-            it = flows.erase(it);
-            flowCnt--;
+// (the metrics endpoint only looks at the first nLiveIfs, which are
+// complete, and the vector is reserved up front so it never moves)
+static std::vector<std::unique_ptr<liveIf>> liveIfs;
+static std::atomic<size_t> nLiveIfs{0};
+static bool tsCounted = false;      // some liveIf has a tsFiltered
 
-            continue;
+// Bring kernelDrops, kernelFiltered and the interfaces' counters up to
+// date (on the capture thread; the stats are read from the capture
+// handles)
+static void pollKernelStats()
+{
+    for (auto& li : liveIfs) {
+        if (li->tsFiltered) {
+            kernelFiltered.add(li->tsFiltered->count());
         }
-        ++it;
+        uint64_t pkts = 0, drops = 0;
+        if (li->ring) {
+            li->ring->stats(pkts, drops);   // (since the previous call)
+        } else {
+            struct pcap_stat st;
+            if (pcap_stats(li->snif->get_pcap_handle(), &st) == 0) {
+                pkts = unsigned(st.ps_recv - li->prevRecv);
+                drops = unsigned(st.ps_drop - li->prevDrops);
+                li->prevRecv = st.ps_recv;
+                li->prevDrops = st.ps_drop;
+            }
+        }
+        li->packets.add(pkts);
+        li->drops.add(drops);
+        kernelDrops.add(drops);
     }
 }
 
-// return the local ip address of 'ifname'
-// XXX since an interface can have multiple addresses, both IP4 and IP6,
-// this should really create a set of all of them and later test for
-// membership. But for now we just take the first IP4 address.
-static std::string localAddrOf(const std::string ifname)
+static void printSummary()
 {
-    std::string local{};
-    struct ifaddrs* ifap;
+    pollKernelStats();
+    std::cerr << total(&ppWorker::flowCnt) << " flows, "
+              << pktCnt.get() - pktBase << " packets, " +
+                 printnz(no_TS.get() - noTsBase, " no TS opt, ") +
+                 printnz(total(&ppWorker::uniDir) - uniDirBase,
+                         " uni-directional, ") +
+                 printnz(not_tcp.get() - notTcpBase, " not TCP, ") +
+                 printnz(not_v4or6.get() - notV4or6Base, " not v4 or v6, ") +
+                 printnz(total(&ppWorker::tsTblFull) - tsTblFullBase,
+                         " TS table full, ") +
+                 printnz(kernelDrops.get() - dropsBase, " dropped by kernel, ") +
+                 printnz(kernelFiltered.get() - filteredBase,
+                         " no TS (kernel filtered), ") +
+                 printnz(samplesLost.get() - samplesLostBase, " samples lost, ") +
+                 "\n";
+}
 
-    if (getifaddrs(&ifap) == 0) {
-        for (auto ifp = ifap; ifp; ifp = ifp->ifa_next) {
-            if (ifname == ifp->ifa_name &&
-                  ifp->ifa_addr->sa_family == AF_INET) {
-                uint32_t ip = ((struct sockaddr_in*)
-                               ifp->ifa_addr)->sin_addr.s_addr;
-                local = IPv4Address(ip).to_string();
-                break;
-            }
+// Write the --flowSnapshot file: the flows as the workers last
+// published them or, once they've stopped ('final'), as they are now
+static void saveSnapshot(bool final)
+{
+    static std::vector<flowSnapRec> recs;
+    recs.clear();
+    for (auto& w : workers) {
+        if (final) {
+            w->snapshot(recs);
+        } else {
+            w->collectSnapshot(recs);
         }
-        freeifaddrs(ifap);
     }
-    return local;
+    try {
+        writeFlowSnapshot(snapFile, recs.data(), recs.size(),
+                          clockNs(CLOCK_REALTIME));
+    } catch (std::runtime_error& ex) {
+        std::cerr << "WARNING: couldn't save flows: " << ex.what() << "\n";
+    }
 }
 
-static inline std::string printnz(int v, const char *s) {
-    return (v > 0? std::to_string(v) + s : "");
+// Give the workers (before they're started) the flows of the
+// --flowSnapshot file that haven't been idle for flowMaxIdle. The
+// capture clock is started now so the flows' times can be set relative
+// to it.
+static void loadSnapshot()
+{
+    std::unique_ptr<flowSnapshot> snap;
+    try {
+        snap.reset(new flowSnapshot(snapFile));
+    } catch (std::runtime_error& ex) {
+        std::cerr << "No flows restored: " << ex.what() << "\n";
+        return;
+    }
+    double now = clockSecs(CLOCK_REALTIME);
+    offTm = int64_t(now);
+    startm = now - double(offTm);
+    capTm = startm;
+    size_t n = 0;
+    const flowSnapRec* r = snap->records();
+    for (size_t i = 0; i < snap->size(); i++, r++) {
+        double last = double(r->lastNs / 1000000000 - offTm) +
+                      double(r->lastNs % 1000000000) * 1e-9;
+        if (capTm - last > flowMaxIdle) {
+            continue;
+        }
+        flowKey key;
+        memcpy(key.src, r->src, sizeof(key.src));
+        memcpy(key.dst, r->dst, sizeof(key.dst));
+        key.sport = r->sport;
+        key.dport = r->dport;
+        n += workers[shardOf(key)]->restoreFlow(key, *r, last);
+    }
+    std::cerr << "Restored " << n << " of " << snap->size() << " flows from "
+              << snapFile << "\n";
 }
 
-static void printSummary()
+// Called after each captured packet to print the periodic summary.
+// Returns false once the packet count or capture time limit is reached.
+static bool afterPacket()
 {
-    std::cerr << flowCnt << " flows, "
-              << pktCnt << " packets, " +
-                 printnz(no_TS, " no TS opt, ") +
-                 printnz(uniDir, " uni-directional, ") +
-                 printnz(not_tcp, " not TCP, ") +
-                 printnz(not_v4or6, " not v4 or v6, ") +
-                 "\n";
+    static double nxtSum = 0.;
+    static double nxtStats = 0.;
+    static double nxtSnap = 0.;
+
+    if ((time_to_run > 0. && capTm - startm >= time_to_run) ||
+        (maxPackets > 0 && pktCnt.get() >= maxPackets)) {
+        printSummary();
+        std::cerr << "Captured " << pktCnt.get() << " packets in "
+                  << (capTm - startm) << " seconds\n";
+        return false;
+    }
+    if (capTm >= nxtSum && sumInt) {
+        if (nxtSum > 0.) {
+            printSummary();
+            pktBase = pktCnt.get();
+            noTsBase = no_TS.get();
+            uniDirBase = total(&ppWorker::uniDir);
+            notTcpBase = not_tcp.get();
+            notV4or6Base = not_v4or6.get();
+            samplesLostBase = samplesLost.get();
+            dropsBase = kernelDrops.get();
+            filteredBase = kernelFiltered.get();
+            tsTblFullBase = total(&ppWorker::tsTblFull);
+        }
+        nxtSum = capTm + sumInt;
+    }
+    if (capTm >= nxtStats) {
+        // (for the exported counter, between summaries)
+        pollKernelStats();
+        nxtStats = capTm + 1.;
+    }
+    if (!snapFile.empty() && capTm >= nxtSnap) {
+        // (the first interval's for the workers to publish their flows)
+        if (nxtSnap > 0.) {
+            saveSnapshot(false);
+        }
+        nxtSnap = capTm + snapInt;
+    }
+    return true;
 }
 
 static struct option opts[] = {
@@ -458,6 +2266,33 @@ static struct option opts[] = {
     { "sumInt",    required_argument, nullptr, 'S' },
     { "tsvalMaxAge", required_argument, nullptr, 'M' },
     { "flowMaxIdle", required_argument, nullptr, 'F' },
+    { "maxTsEntries", required_argument, nullptr, 'T' },
+    { "maxFlows",  required_argument, nullptr, 'X' },
+    { "threads",   required_argument, nullptr, 'N' },
+    { "capture",   required_argument, nullptr, 'C' },
+    { "ringBlockSize", required_argument, nullptr, 'B' },
+    { "ringFrames", required_argument, nullptr, 'R' },
+    { "ringTimeout", required_argument, nullptr, 'O' },
+    { "bpfObj",    required_argument, nullptr, 'E' },
+    { "metric-type", required_argument, nullptr, 'H' },
+    { "srcPrefix", required_argument, nullptr, 'P' },
+    { "srcGroup",  required_argument, nullptr, 'G' },
+    { "topSrc",    required_argument, nullptr, 'K' },
+    { "output",    required_argument, nullptr, 'W' },
+    { "sampleRate", required_argument, nullptr, 'U' },
+    { "sampleEvery", required_argument, nullptr, 'V' },
+    { "sampleDelta", required_argument, nullptr, 'D' },
+    { "flowStats", required_argument, nullptr, 'A' },
+    { "flowAdmit", no_argument,       nullptr, 'Q' },
+    { "noTsPrefilter", no_argument,   nullptr, 'Z' },
+    { "seqMatch",  no_argument,       nullptr, 'g' },
+    { "hwTimestamps", no_argument,    nullptr, 'e' },
+    { "flowSnapshot", required_argument, nullptr, 'I' },
+    { "snapshotInt", required_argument, nullptr, 'n' },
+#ifdef PPING_BENCH
+    { "bench",     required_argument, nullptr, 'Y' },
+    { "benchTrace", required_argument, nullptr, 'J' },
+#endif
     { "help",      no_argument,       nullptr, 'h' },
     { "listen", required_argument, nullptr, 'a' },
     { "localSubnet", required_argument, nullptr, 'L' },
@@ -471,14 +2306,25 @@ static void usage(const char* pname) {
 static void help(const char* pname) {
     usage(pname);
     std::cerr << " flags:\n"
-"  -i|--interface ifname   do live capture from interface <ifname>\n"
+"  -i|--interface ifname   do live capture from interface <ifname>. Can\n"
+"                     be specified multiple times (not with\n"
+"                     --capture=ebpf) to pair the directions of flows\n"
+"                     that cross different interfaces\n"
 "\n"
-"  -r|--read pcap     process capture file <pcap>\n"
+"  -r|--read pcap     process capture file <pcap> (pcap or pcapng,\n"
+"                     optionally gzip or zstd compressed). Can be specified\n"
+"                     multiple times, as a directory or glob, or\n"
+"                     followed by more files; the files are then read\n"
+"                     in parallel and merged in timestamp order.\n"
 "\n"
 "  -f|--filter expr   pcap filter applied to packets.\n"
 "                     Eg., \"-f 'net 74.125.0.0/16 or 45.57.0.0/17'\"\n"
 "                     only shows traffic to/from youtube or netflix.\n"
 "\n"
+"  --noTsPrefilter    don't have the kernel drop (live captured) TCP\n"
+"                     packets without a timestamp option in its usual\n"
+"                     place; they're then counted as 'no TS' instead.\n"
+"\n"
 "  -m|--machine       'machine readable' output format suitable\n"
 "                     for graphing or post-processing. Timestamps\n"
 "                     are printed as seconds since capture start.\n"
@@ -486,6 +2332,31 @@ static void help(const char* pname) {
 "                     times have a resolution of 1us (6 digits after\n"
 "                     decimal point).\n"
 "\n"
+"  --output fmt       RTT sample output format: 'text' (default; human\n"
+"                     or -m readable), 'csv' (with a header line) or\n"
+"                     'binary' (fixed-size records, see output.h)\n"
+"\n"
+"  --sampleRate num   output (and export) at most <num> RTT samples per\n"
+"                     flow per second\n"
+"\n"
+"  --sampleEvery num  output only 1 in <num> RTT samples of each flow\n"
+"\n"
+"  --sampleDelta pct  output only RTT samples more than <pct> percent\n"
+"                     over the flow's min. With any of these, a new min\n"
+"                     is always output, and flows that are being\n"
+"                     rate limited record fewer TSvals.\n"
+"\n"
+"  --flowStats secs   export each flow's smoothed RTT, its deviation,\n"
+"                     and the min, max, median and 95th percentile of\n"
+"                     its RTTs over every <secs> interval (of all its\n"
+"                     RTTs, before any --sample* limit)\n"
+"\n"
+"  --flowSnapshot file save the flows (their min RTTs, byte counts and\n"
+"                     last times) to <file> every --snapshotInt secs\n"
+"                     (default 60) and at exit, and restore the ones not\n"
+"                     idle for --flowMaxIdle from it at startup (live\n"
+"                     capture only, not with --capture=ebpf)\n"
+"\n"
 "  -c|--count num     stop after capturing <num> packets\n"
 "\n"
 "  -s|--seconds num   stop after capturing for <num> seconds \n"
@@ -498,77 +2369,439 @@ static void help(const char* pname) {
 "\n"
 "  --sumInt num       summary report print interval (default 10s)\n"
 "\n"
-"  --tsvalMaxAge num  max age of an unmatched tsval (default 10s)\n"
+"  --tsvalMaxAge num  max age of an unmatched tsval (default 10s, at\n"
+"                     most 240s)\n"
+"\n"
+"  --seqMatch         only match an ECR once the packet's ACK covers the\n"
+"                     data of the TSval's first packet, which keeps\n"
+"                     delayed or earlier ACKs from inflating RTTs\n"
 "\n"
 "  --flowMaxIdle num  flows idle longer than <num> are deleted (default 300s)\n"
 "\n"
+"  --maxTsEntries num max number of saved TSvals (default 500000). The\n"
+"                     TSval table is allocated up front for this many.\n"
+"\n"
+"  --maxFlows num     max number of flows tracked (default 10000). Flow\n"
+"                     records are allocated up front for this many. When\n"
+"                     they're all in use, an unused uni-directional flow\n"
+"                     (or failing that the stalest flow) is evicted.\n"
+"\n"
+"  --flowAdmit        only track a flow once both of its directions have\n"
+"                     been seen, so scans and floods don't fill the table\n"
+"\n"
+"  --threads num      shard flows over <num> worker threads (default 1).\n"
+"                     Both directions of a flow go to the same worker.\n"
+"                     The flow and TSval table limits are split between them.\n"
+"\n"
+"  --capture type     live capture backend: 'pcap' (default), 'afpacket'\n"
+"                     (AF_PACKET TPACKET_V3 memory-mapped ring, Linux only)\n"
+"                     or 'ebpf' (TSval matching done in the kernel by a TC\n"
+"                     program; needs a 'make BPF=1' build and root)\n"
+"\n"
+"  --ringBlockSize num  afpacket ring block size in bytes (default 1MB)\n"
+"\n"
+"  --ringFrames num   afpacket ring size in (snap length) frames (default 256K)\n"
+"\n"
+"  --ringTimeout num  ms before a partly filled ring block is handed\n"
+"                     over anyway (default 10)\n"
+"\n"
+"  --hwTimestamps     have the interface's adapter timestamp frames (pcap\n"
+"                     or afpacket; its clock should be kept in step with\n"
+"                     the system's, e.g. by phc2sys)\n"
+"\n"
+"  --bpfObj file      eBPF object to load (default pping.bpf.o)\n"
+"\n"
+"  --metric-type type  export RTTs as a Prometheus 'summary' (default;\n"
+"                     quantiles of each series' recent samples) or\n"
+"                     'histogram' (fixed log-linear buckets from 10us\n"
+"                     to 168s, which can be aggregated across series)\n"
+"\n"
+"  --srcPrefix v4[,v6] label RTT series with the source's /v4 (IPv4) or\n"
+"                     /v6 (IPv6) network rather than its address,\n"
+"                     e.g. \"--srcPrefix 24,48\"\n"
+"\n"
+"  --srcGroup name=cidr  label sources in <cidr> as <name>. Can be\n"
+"                     specified multiple times; the first match wins.\n"
+"\n"
+"  --topSrc num       only the <num> source labels with the most samples\n"
+"                     get their own series, the rest are labelled 'other'\n"
+"\n"
 "  -a|--listen addr   HTTP listening address for Prometheus to scrape.\n"
 "                     Default: 0.0.0.0:9876.\n"
 "\n"
 "  -L|--localSubnet   Local subnet range to ignore, specified in CIDR format\n"
-"                     (e.g. 172.16.0.0/24). Can be specified multiple times.\n"
+"                     (e.g. 172.16.0.0/24 or fd00::/8). Can be specified\n"
+"                     multiple times.\n"
 "                     NOTE: If the -l (or --showLocal) flag is enabled, then\n"
 "                     this flag will not be considered.\n"
 "\n"
+#ifdef PPING_BENCH
+"  --bench runs       replay the -r file (or --benchTrace) from memory\n"
+"                     <runs> times and report packets/s, samples/s,\n"
+"                     ns/packet percentiles, peak table sizes and\n"
+"                     allocations/packet. Output goes to /dev/null and\n"
+"                     there's no Prometheus endpoint.\n"
+"\n"
+"  --benchTrace kind  generated trace to replay: 'bulk' (default),\n"
+"                     'short' or 'synflood'\n"
+"\n"
+#endif
 "  -h|--help          print help then exit\n"
 ;
 }
 
-static BaseSniffer* snif = nullptr;
+// Has program caught any OS signals (or finished reading its input)
+static std::atomic<bool> gINTERRUPTED{false};
 
-static bool gINTERRUPTED = false; // Has program caught any OS signals
+static void signalHandler(int sigVal) {
+    if (snif) {
+        snif->stop_sniff();
+    }
+    gINTERRUPTED = true;
+}
+
+static bool captureStop = false;    // (set by a pcapFrame() call)
 
-static void flushLoop() {
-    while ( !gINTERRUPTED ) {
-        fflush(stdout);
-        std::this_thread::sleep_for(std::chrono::microseconds(flushInt));
+// a frame from a libpcap interface of liveIfs ('u')
+static void pcapFrame(u_char* u, const struct pcap_pkthdr* hdr,
+                      const u_char* data)
+{
+    liveIf* li = reinterpret_cast<liveIf*>(u);
+    process_frame(data, hdr->caplen, li->dlt, hdr->ts.tv_sec,
+                  hdr->ts.tv_usec * li->nsMul);
+    if (!afterPacket()) {
+        captureStop = true;
+        pcap_breakloop(li->snif->get_pcap_handle());
     }
 }
 
-static void cleanUpLoop() {
-    double currTime;
-    while ( !gINTERRUPTED ) {
-        if (offTm > 0) {
-            currTime = (double)(static_cast<int64_t>(Timestamp::current_time().seconds()) - offTm);
-            cleanUp(currTime);  // get rid of stale entries
+// Capture from several interfaces (-i given more than once) on this
+// thread, so the workers' rings still have a single producer: each
+// interface that has frames is read in turn, a ring block or up to
+// BURST (non-blocking) libpcap frames at a time, and poll() waits on
+// all of them when none has any. Both directions of a flow then reach
+// the same worker whichever interfaces they cross. (libpcap's frames
+// are processed in its callback: it may return their buffer to the
+// kernel before pcap_dispatch() does.)
+static void captureIfs()
+{
+    std::vector<struct pollfd> pfds;
+    for (auto& li : liveIfs) {
+        int fd = li->ring ? li->ring->fd()
+                          : pcap_get_selectable_fd(li->snif->get_pcap_handle());
+        pfds.push_back(pollfd{fd, POLLIN | POLLERR, 0});
+    }
+    while (!gINTERRUPTED && !captureStop) {
+        bool idle = true;
+        for (auto& li : liveIfs) {
+            if (li->ring) {
+                if (!li->ring->ready()) {
+                    continue;
+                }
+                idle = false;
+                captureStop = !li->ring->next(0, burstMax(),
+                                  [](const frameSpan* f, size_t n) {
+                                      process_burst(f, n);
+                                      return afterPacket();
+                                  });
+            } else {
+                pcap_t* ph = li->snif->get_pcap_handle();
+                int r = pcap_dispatch(ph, int(burstMax()), pcapFrame,
+                                      reinterpret_cast<u_char*>(li.get()));
+                if (r == PCAP_ERROR) {
+                    std::cerr << li->name << ": " << pcap_geterr(ph) << "\n";
+                    captureStop = true;
+                }
+                idle = idle && r == 0;
+            }
+            if (captureStop) {
+                break;
+            }
+        }
+        if (idle && !captureStop) {
+            if (poll(pfds.data(), pfds.size(), 250) == 0) {
+                idleTick();
+            }
+            captureStop = !afterPacket();
         }
-        std::this_thread::sleep_for(std::chrono::seconds((int64_t)tsvalMaxAge));
     }
 }
 
-static void signalHandler(int sigVal) {
-    if (snif) {
-        snif->stop_sniff();
-        gINTERRUPTED = true;
+#ifdef PPING_WITH_BPF
+// eBPF capture: the TC program (bpf/pping.bpf.c) keeps the flow and TSval
+// tables in the kernel and only RTT samples come up to user space. All
+// that's tracked here is which flows have a Prometheus series, so the
+// series can be deleted once the flow has been idle for flowMaxIdle.
+static bpfMatcher* bpfm = nullptr;
+static std::string bpfObj("pping.bpf.o");
+static int64_t bpfClockOffNs;   // CLOCK_REALTIME - CLOCK_MONOTONIC
+struct bpfFlow
+{
+    double last;        // time of the latest sample
+    seriesRef metric;
+};
+static std::unordered_map<flowKey, bpfFlow, flowKeyHash> bpfSeries;
+static std::unique_ptr<expiryWheel<flowKey>> bpfSeriesWheel;
+
+static_assert(sizeof(struct pp_flow_key) == sizeof(flowKey),
+              "kernel and user space flow keys differ");
+
+static void bpfSample(const struct pp_sample& s)
+{
+    flowKey key;
+    memcpy(&key, &s.flow, sizeof(key));
+    int64_t capNs = int64_t(s.ts) + bpfClockOffNs - offTm * 1000000000;
+    double tm = double(capNs) * 1e-9;
+    // the workers are idle in this mode so the series go in the first
+    // worker's shard
+    auto res = bpfSeries.emplace(key, bpfFlow{tm, seriesRef()});
+    if (res.second) {
+        bpfSeriesWheel->schedule(key, tm + flowMaxIdle);
+    } else {
+        res.first->second.last = tm;
+    }
+    double rtt = double(s.rtt) * 1e-9;
+    emitSample(0, key, capNs, rtt, double(s.min) * 1e-9,
+               double(s.fBytes), double(s.dBytes), double(s.pBytes));
+    observeRtt(rttMetric->shard(0), res.first->second.metric, key, rtt);
+}
+
+// Load the TC program on 'ifname' and hand it the limits, ages and local
+// address ranges.
+static bpfMatcher* openBpf(const std::string& ifname)
+{
+    struct pp_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.tsvalMaxAge = uint64_t(tsvalMaxAge * 1e9);
+    cfg.flowMaxIdle = uint64_t(flowMaxIdle * 1e9);
+    cfg.filtLocal = filtLocal;
+    auto* m = new bpfMatcher(bpfObj, ifname, maxFlows, maxTsEntries, cfg,
+                             bpfSample);
+    for (const auto& p : localNets.prefixes()) {
+        m->addLocal(p.v4 ? p.addr + 12 : p.addr, !p.v4, p.hostLen());
     }
+    return m;
 }
 
-// Validate strRanges are proper CIDR notation and return IPv4Range object
-IPv4Range convertStrRange(string range) {
-    auto slashIdx = range.find('/');
-    if (slashIdx == string::npos) {
-        std::cerr << "ERROR: " << range << " is valid CIDR notation" << std::endl;
-        throw invalid_address();
+// The capture loop of eBPF mode: collect samples and the kernel's packet
+// counters, and expire idle series.
+static void bpfLoop()
+{
+    uint64_t prev[PP_NCOUNTERS] = {}, cur[PP_NCOUNTERS];
+    while (!gINTERRUPTED) {
+        bpfm->poll(250);
+        bpfm->counters(cur);
+        pktCnt.add(cur[PP_PKTS] - prev[PP_PKTS]);
+        not_tcp.add(cur[PP_NOT_TCP] - prev[PP_NOT_TCP]);
+        no_TS.add(cur[PP_NO_TS] - prev[PP_NO_TS]);
+        not_v4or6.add(cur[PP_NOT_V4OR6] - prev[PP_NOT_V4OR6]);
+        samplesLost.add(cur[PP_SAMPLES_LOST] - prev[PP_SAMPLES_LOST]);
+        workers[0]->uniDir.add(cur[PP_UNIDIR] - prev[PP_UNIDIR]);
+        memcpy(prev, cur, sizeof(prev));
+
+        capTm = clockSecs(CLOCK_REALTIME) - offTm;
+        bpfSeriesWheel->advance(capTm, [](const flowKey& key) {
+            auto it = bpfSeries.find(key);
+            if (it == bpfSeries.end()) {
+                return;
+            }
+            if (capTm - it->second.last > flowMaxIdle) {
+                releaseSeries(rttMetric->shard(0), it->second.metric);
+                bpfSeries.erase(it);
+            } else {
+                bpfSeriesWheel->schedule(key, it->second.last + flowMaxIdle);
+            }
+        });
+        // (flows with samples; the kernel's flow table isn't walked)
+        workers[0]->flowCnt.add(int64_t(bpfSeries.size()) -
+                                workers[0]->flowCnt.get());
+        if (!afterPacket()) {
+            break;
+        }
     }
+}
+#endif
 
-    string ip = range.substr(0, slashIdx);
-    string cidr = range.substr(slashIdx + 1);
+// The per-flow statistics of the last --flowStats interval, one series
+// per flow (and quantile), in ms
+static void renderFlowStats(std::string& out)
+{
+    std::vector<flowStatsRec> recs;
+    for (const auto& w : workers) {
+        w->collectStats(recs);
+    }
+    static const vector<std::string> names =
+        {"srcIP", "srcPort", "dstIP", "dstPort"};
+    std::vector<std::pair<std::string, double>> srtt, sd, mn, mx, q, n;
+    for (const auto& r : recs) {
+        bool v4 = r.key.isV4();
+        std::string l = promLabels(names, {addrToString(r.key.src, v4),
+                                           std::to_string(r.key.sport),
+                                           addrToString(r.key.dst, v4),
+                                           std::to_string(r.key.dport)});
+        srtt.emplace_back(l, r.srtt * 1000);
+        sd.emplace_back(l, r.stddev * 1000);
+        mn.emplace_back(l, r.min * 1000);
+        mx.emplace_back(l, r.max * 1000);
+        q.emplace_back(l + ",quantile=\"0.5\"", r.p50 * 1000);
+        q.emplace_back(l + ",quantile=\"0.95\"", r.p95 * 1000);
+        n.emplace_back(l, r.count);
+    }
+    promSimple(out, "pping_flow_rtt_smoothed_ms", "gauge",
+               "Exponentially weighted moving average of the flow's RTTs", srtt);
+    promSimple(out, "pping_flow_rtt_stddev_ms", "gauge",
+               "Exponentially weighted standard deviation of the flow's RTTs", sd);
+    promSimple(out, "pping_flow_rtt_min_ms", "gauge",
+               "Min RTT of the flow over the last interval", mn);
+    promSimple(out, "pping_flow_rtt_max_ms", "gauge",
+               "Max RTT of the flow over the last interval", mx);
+    promSimple(out, "pping_flow_rtt_quantile_ms", "gauge",
+               "Estimated RTT quantiles of the flow over the last interval", q);
+    promSimple(out, "pping_flow_rtt_samples", "gauge",
+               "RTTs of the flow over the last interval", n);
+}
 
-    if (ip.size() == 0 || cidr.size() == 0) {
-        std::cerr << "ERROR: " << range << " is valid CIDR notation" << std::endl;
-        throw invalid_address();
+// The exporter's own metrics. Everything is read from the per-thread
+// counters here, at scrape time.
+static void renderSelfMetrics(std::string& out)
+{
+    int64_t tsCap = 0;
+    for (const auto& w : workers) {
+        tsCap += w->tsCapacity();
+    }
+    int64_t tsCnt = total(&ppWorker::tsCnt);
+
+    promSimple(out, "pping_exporter_packets_total", "counter",
+               "Packets captured", {{"", double(pktCnt.get())}});
+    promSimple(out, "pping_exporter_packets_skipped_total", "counter",
+               "Packets that couldn't give an RTT sample, by reason",
+               {{"reason=\"not_tcp\"", double(not_tcp.get())},
+                {"reason=\"no_ts\"", double(no_TS.get())},
+                {"reason=\"not_v4or6\"", double(not_v4or6.get())},
+                {"reason=\"uni_dir\"", double(total(&ppWorker::uniDir))}});
+    promSimple(out, "pping_exporter_kernel_drops_total", "counter",
+               "Packets dropped by the kernel (pcap or AF_PACKET ring)",
+               {{"", double(kernelDrops.get())}});
+    if (tsCounted) {
+        promSimple(out, "pping_exporter_kernel_filtered_total", "counter",
+                   "TCP packets without a usable timestamp option dropped "
+                   "by the kernel's capture filter",
+                   {{"", double(kernelFiltered.get())}});
     }
+    if (nLiveIfs > 0) {
+        std::vector<std::pair<std::string, double>> pkts, drops;
+        for (size_t i = 0; i < nLiveIfs; i++) {
+            const liveIf& li = *liveIfs[i];
+            std::string l = "interface=\"" + li.name + "\"";
+            pkts.emplace_back(l, double(li.packets.get()));
+            drops.emplace_back(l, double(li.drops.get()));
+        }
+        promSimple(out, "pping_exporter_interface_packets_total", "counter",
+                   "Packets the capture filter passed on each interface, "
+                   "including those the kernel dropped", pkts);
+        promSimple(out, "pping_exporter_interface_kernel_drops_total",
+                   "counter", "Packets dropped by the kernel on each "
+                   "interface", drops);
+    }
+    promSimple(out, "pping_exporter_rtt_samples_total", "counter",
+               "RTT samples", {{"", double(total(&ppWorker::samples))}});
+    promSimple(out, "pping_exporter_rtt_samples_sampled_out_total", "counter",
+               "RTT matches not output because of --sample* limits",
+               {{"", double(total(&ppWorker::sampledOut))}});
+    promSimple(out, "pping_exporter_metric_updates_dropped_total", "counter",
+               "RTTs not added to pping_service_rtt because the metric "
+               "update queue was full",
+               {{"", double(total(&ppWorker::metricsDropped))}});
+    promSimple(out, "pping_exporter_samples_lost_total", "counter",
+               "RTT samples lost by the eBPF ring buffer",
+               {{"", double(samplesLost.get())}});
+    promSimple(out, "pping_exporter_flows", "gauge", "Flows tracked",
+               {{"", double(total(&ppWorker::flowCnt))}});
+    promSimple(out, "pping_exporter_flows_evicted_total", "counter",
+               "Flows deleted to make room in the full flow table",
+               {{"", double(total(&ppWorker::flowsEvicted))}});
+    promSimple(out, "pping_exporter_ts_entries", "gauge",
+               "Saved TSvals", {{"", double(tsCnt)}});
+    promSimple(out, "pping_exporter_ts_load_factor", "gauge",
+               "Saved TSvals over the TSval table's capacity",
+               {{"", tsCap > 0 ? double(tsCnt) / tsCap : 0.}});
+    promSimple(out, "pping_exporter_ts_table_full_total", "counter",
+               "TSvals not saved because the TSval table was full",
+               {{"", double(total(&ppWorker::tsTblFull))}});
+    promSimple(out, "pping_exporter_cleanup_seconds_total", "counter",
+               "Time spent aging the flow and TSval tables",
+               {{"", total(&ppWorker::cleanNs) * 1e-9}});
+    procMetric->render(out);
+}
+
+#ifdef PPING_BENCH
+// Bench mode: replay an in-memory trace 'runs' times through the packet
+// path on this thread (a single worker, no Prometheus endpoint, samples
+// formatted to /dev/null) and report its throughput and costs.
 
-    IPv4Address ipAddr = IPv4Address(ip);
-    int cidrInt = stoi(cidr);
+static std::atomic<uint64_t> benchAllocs{0};
 
-    // libtins seems to treat /32 as /0... manually return range of 1
-    if (cidrInt == 32) {
-        return IPv4Range(ipAddr, ipAddr);
+void* operator new(size_t n)
+{
+    benchAllocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(n ? n : 1)) {
+        return p;
     }
+    throw std::bad_alloc();
+}
 
-    return ipAddr / cidrInt;
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+static void runBench(const benchTrace& tr, int runs)
+{
+    if (tr.size() == 0) {
+        std::cerr << "bench: empty trace\n";
+        return;
+    }
+    // each run starts after everything from the previous one has aged
+    // out, so they all do the same work
+    double gap = std::ceil(tr.span() + std::max(tsvalMaxAge, flowMaxIdle) + 2.);
+    uint64_t total = uint64_t(tr.size()) * runs;
+    latencySamples lat(total, 1 << 22);
+    ppWorker& w = *workers[0];
+    int64_t peakFlows = 0;
+    int64_t peakTs = 0;
+    uint64_t allocs0 = benchAllocs.load();
+    int64_t samples0 = w.samples.get();
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < runs; r++) {
+        int64_t shift = int64_t(gap) * r;
+        for (size_t i = 0; i < tr.size(); i++) {
+            const benchFrame& f = tr[i];
+            auto t0 = std::chrono::steady_clock::now();
+            process_frame(tr.data(f), f.caplen, tr.dlt(), f.sec + shift, f.nsec);
+            auto t1 = std::chrono::steady_clock::now();
+            lat.add(uint32_t(std::chrono::duration_cast<
+                             std::chrono::nanoseconds>(t1 - t0).count()));
+            if ((i & 1023) == 0) {
+                peakFlows = std::max(peakFlows, w.flowCnt.get());
+                peakTs = std::max(peakTs, w.tsCnt.get());
+            }
+        }
+    }
+    double secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start).count();
+    uint64_t allocs = benchAllocs.load() - allocs0;
+    int64_t samples = w.samples.get() - samples0;
+
+    printf("%zu packets x %d runs in %.3f s\n", tr.size(), runs, secs);
+    printf("  %.0f packets/s, %.0f RTT samples/s (%" PRId64 " samples)\n",
+           total / secs, samples / secs, samples);
+    printf("  ns/packet: p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+           lat.quantile(0.5), lat.quantile(0.9), lat.quantile(0.99),
+           lat.quantile(0.999), lat.quantile(1.));
+    printf("  peak flows %" PRId64 ", peak TSval entries %" PRId64 "\n",
+           peakFlows, peakTs);
+    printf("  %.4f allocations/packet\n", double(allocs) / total);
 }
+#endif
 
 int main(int argc, char* const* argv)
 {
@@ -581,7 +2814,17 @@ int main(int argc, char* const* argv)
     sigaction (SIGTERM, &action, NULL);
 
     bool liveInp = false;
+    bool useAfPacket = false;
+    bool useBpf = false;
+#ifdef PPING_BENCH
+    int benchRuns = 0;
+    std::string benchKind;
+#endif
+    afPacketConfig afCfg;
+    bool hwTimestamps = false;
     std::string fname;
+    std::vector<std::string> ifNames;       // -i interfaces
+    std::vector<std::string> readSpecs;     // -r files, globs, directories
     if (argc <= 1) {
         help(argv[0]);
         exit(1);
@@ -589,8 +2832,17 @@ int main(int argc, char* const* argv)
     for (int c; (c = getopt_long(argc, argv, "i:r:f:c:s:a:L:hlmqv",
                                  opts, nullptr)) != -1; ) {
         switch (c) {
-        case 'i': liveInp = true; fname = optarg; break;
-        case 'r': fname = optarg; break;
+        case 'i':
+            liveInp = true;
+            ifNames.push_back(optarg);
+            fname = ifNames[0];
+            break;
+        case 'r':
+            if (fname.empty()) {
+                fname = optarg;
+            }
+            readSpecs.push_back(optarg);
+            break;
         case 'f': filter += " and (" + std::string(optarg) + ")"; break;
         case 'c': maxPackets = atof(optarg); break;
         case 's': time_to_run = atof(optarg); break;
@@ -599,33 +2851,213 @@ int main(int argc, char* const* argv)
         case 'l': filtLocal = false; break;
         case 'm': machineReadable = true; break;
         case 'S': sumInt = atof(optarg); break;
-        case 'M': tsvalMaxAge = atof(optarg); break;
+        case 'M': tsvalMaxAge = std::min(atof(optarg), TS_MAX_AGE); break;
         case 'F': flowMaxIdle = atof(optarg); break;
+        case 'T': maxTsEntries = strtoul(optarg, nullptr, 10); break;
+        case 'X': maxFlows = std::max(atoi(optarg), 1); break;
+        case 'N': nThreads = std::max(atoi(optarg), 1); break;
+        case 'C':
+            if (std::string(optarg) == "afpacket") {
+                useAfPacket = true;
+            } else if (std::string(optarg) == "ebpf") {
+#ifdef PPING_WITH_BPF
+                useBpf = true;
+#else
+                std::cerr << "Not built with eBPF support (make BPF=1)\n";
+                exit(1);
+#endif
+            } else if (std::string(optarg) != "pcap") {
+                std::cerr << "Unknown capture type " << optarg << "\n";
+                exit(1);
+            }
+            break;
+        case 'B': afCfg.blockSize = strtoul(optarg, nullptr, 10); break;
+        case 'R': afCfg.frames = strtoul(optarg, nullptr, 10); break;
+        case 'O': afCfg.blockTimeout = strtoul(optarg, nullptr, 10); break;
+#ifdef PPING_WITH_BPF
+        case 'E': bpfObj = optarg; break;
+#endif
+        case 'H':
+            if (std::string(optarg) == "histogram") {
+                rttMetricType = METRIC_HISTOGRAM;
+            } else if (std::string(optarg) != "summary") {
+                std::cerr << "Unknown metric type " << optarg << "\n";
+                exit(1);
+            }
+            break;
+        case 'W':
+            outFormat = optarg;
+            if (outFormat != "text" && outFormat != "csv" &&
+                outFormat != "binary") {
+                std::cerr << "Unknown output format " << optarg << "\n";
+                exit(1);
+            }
+            break;
+        case 'U': sampleRate = std::max(atoi(optarg), 0); break;
+        case 'V': sampleEvery = std::max(atoi(optarg), 1); break;
+        case 'D': sampleDelta = std::max(atof(optarg), 0.) / 100.; break;
+        case 'A': statsInt = std::max(atof(optarg), 0.); break;
+        case 'Q': flowAdmit = true; break;
+        case 'Z': tsPrefilter = false; break;
+        case 'g': seqMatch = true; break;
+        case 'e': hwTimestamps = afCfg.hwTimestamps = true; break;
+        case 'I': snapFile = optarg; break;
+        case 'n': snapInt = std::max(atof(optarg), 1.); break;
+        case 'P': {
+            char* end;
+            int v4 = strtol(optarg, &end, 10);
+            int v6 = (*end == ',') ? atoi(end + 1) : 0;
+            srcLabels.setPrefix(v4, v6);
+            break;
+        }
+        case 'G': {
+            std::string g(optarg);
+            auto eq = g.find('=');
+            try {
+                if (eq == std::string::npos || eq == 0) {
+                    throw std::invalid_argument("expected name=cidr");
+                }
+                srcLabels.addGroup(g.substr(0, eq), g.substr(eq + 1));
+            } catch (std::invalid_argument& ex) {
+                std::cerr << "ERROR: bad --srcGroup " << g << ": " << ex.what() << "\n";
+                exit(1);
+            }
+            break;
+        }
+        case 'K': srcLabels.setTopK(strtoul(optarg, nullptr, 10)); break;
+#ifdef PPING_BENCH
+        case 'Y': benchRuns = std::max(atoi(optarg), 1); break;
+        case 'J': benchKind = optarg; break;
+#endif
         case 'h': help(argv[0]); exit(0);
         case 'a': listenAddr = std::string(optarg); break;
         case 'L': strRanges.push_back(std::string(optarg)); break;
         }
     }
+    // further arguments are more files to read (e.g. a shell glob)
+    if (!liveInp && !readSpecs.empty()) {
+        for (; optind < argc; optind++) {
+            readSpecs.push_back(argv[optind]);
+        }
+    }
+    std::vector<std::string> inFiles;
+    for (const auto& spec : readSpecs) {
+        try {
+            pcapMerge::expand(spec, inFiles);
+        } catch (std::exception& ex) {
+            std::cerr << ex.what() << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!inFiles.empty()) {
+        fname = inFiles[0];
+    }
+#ifdef PPING_BENCH
+    if (benchRuns > 0) {
+        if (liveInp || useBpf || useAfPacket) {
+            std::cerr << "--bench replays a file (-r) or --benchTrace\n";
+            exit(1);
+        }
+        nThreads = 1;
+        sumInt = 0.;
+        if (fname.empty() && benchKind.empty()) {
+            benchKind = "bulk";
+        }
+    }
+    if (optind < argc || (fname.empty() && benchKind.empty())) {
+#else
     if (optind < argc || fname.empty()) {
+#endif
         usage(argv[0]);
         exit(1);
     }
+    if (useBpf && ifNames.size() != 1) {
+        std::cerr << "--capture=ebpf needs an interface (-i), and only one\n";
+        exit(1);
+    }
+    if (seqMatch && useBpf) {
+        std::cerr << "--seqMatch isn't available with --capture=ebpf\n";
+        exit(1);
+    }
+    if (!snapFile.empty() && (!liveInp || useBpf)) {
+        std::cerr << "--flowSnapshot needs a libpcap or afpacket live capture\n";
+        exit(1);
+    }
+
+    rttMetric.reset(new metricFamily("pping_service_rtt", "Per-flow RTT "
+            "from source IP to a given destination IP/port", rttMetricType,
+            {0.5, 0.9, 0.99}, nThreads));
+    procMetric.reset(new metricFamily("pping_exporter_packet_process_us",
+            "Time a worker takes to process a packet, in microseconds "
+            "(1 in " + std::to_string(LAT_SAMPLE) + " packets)",
+            METRIC_HISTOGRAM, {}, nThreads));
 
     // Start Prometheus exporter
     // TODO: Make path configurable?
-    std::string listenAddr(":9876"); // HTTP endpoint for Prometheus to scrape
-    StartPromHandler(listenAddr.c_str(), "/metrics");
+#ifdef PPING_BENCH
+    if (benchRuns == 0)
+#endif
+    try {
+        new metricsServer(listenAddr, "/metrics", []() {
+            std::string out;
+            rttMetric->render(out);
+            if (statsInt > 0.) {
+                renderFlowStats(out);
+            }
+            renderSelfMetrics(out);
+            return out;
+        });
+    } catch (std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < nThreads; i++) {
+        workers.emplace_back(new ppWorker((maxFlows + nThreads - 1) / nThreads,
+                                          (maxTsEntries + nThreads - 1) / nThreads,
+                                          procMetric->shard(i), i));
+    }
+    metricsOut = new metricUpdater(*rttMetric, workers.size(),
+                                   (maxFlows + nThreads - 1) / nThreads);
+    metricsOut->start();
+    if (!snapFile.empty()) {
+        loadSnapshot();
+    }
 
-    vector<string> summaryLabels = {"srcIP", "dstIP", "dstPort"};
-    unordered_map<double, double> summaryObj = {{0.5, 0.05}, {0.9, 0.01}, {0.99, 0.001}};
-    flowSummaryVec = SummaryVec("pping_service_rtt", "Per-flow RTT " \
-            "from source IP to a given destination IP/port", summaryLabels,
-            summaryObj, (int)flowMaxIdle, 10);
+    // Validate strRanges are proper CIDR notation and add to localNets
+    for (const auto& str : strRanges) {
+        try {
+            localNets.add(str);
+        } catch (const std::invalid_argument& ex) {
+            std::cerr << "ERROR: " << ex.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    // Validate strRanges are proper CIDR notation and add to localRanges
-    for (auto str: strRanges) {
-        localRanges.push_back(convertStrRange(str));
+#ifdef PPING_BENCH
+    if (benchRuns > 0) {
+        benchTrace tr;
+        try {
+            if (!fname.empty()) {
+                tr.load(fname);
+            } else {
+                tr.generate(benchKind, 1000000);
+            }
+        } catch (std::exception& ex) {
+            std::cerr << "bench: " << ex.what() << "\n";
+            exit(EXIT_FAILURE);
+        }
+        int devNull = open("/dev/null", O_WRONLY);
+        sampleOut = new sampleWriter(devNull,
+                                     machineReadable ? fmtMachine : fmtHuman,
+                                     1, flushInt);
+        sampleOut->start();
+        runBench(tr, benchRuns);
+        sampleOut->stop();
+        metricsOut->stop();
+        exit(0);
     }
+#endif
 
     {
         SnifferConfiguration config;
@@ -636,27 +3068,111 @@ int main(int argc, char* const* argv)
 
         try {
             if (liveInp) {
-                snif = new Sniffer(fname, config);
                 if (filtLocal) {
-                    std::string ip = localAddrOf(fname);
-                    if (ip.empty() && localRanges.empty()) {
+                    // (before the capture is opened: the eBPF program is
+                    // handed the addresses when it's loaded)
+                    for (const auto& ifn : ifNames) {
+                        localAddrsOf(ifn, localNets);
+                    }
+                    if (localNets.empty()) {
                         // Couldn't get local IP address from interface and no
                         // local ranges specified, disabling filtLocal
-                        printf("WARNING: Unable to determine local addresses, disabling filtLocal\n");
+                        std::cerr << "WARNING: Unable to determine local addresses, disabling filtLocal\n";
                         filtLocal = false;
-                    } else if (!ip.empty()) {
-                        localIP = IPv4Address(ip);
-                        localRanges.push_back(IPv4Range(localIP, localIP));
+                    }
+                }
+                std::string liveFilter = filter;
+                if (tsPrefilter) {
+                    liveFilter += std::string(" and (") + tsFilter + ")";
+                }
+                bool several = ifNames.size() > 1;
+                liveIfs.reserve(ifNames.size());
+                for (size_t i = 0; !useBpf && i < ifNames.size(); i++) {
+                    const std::string& ifn = ifNames[i];
+                    fname = ifn;    // (for the error message)
+                    std::unique_ptr<liveIf> li(new liveIf(ifn));
+                    if (useAfPacket) {
+                        li->ring = new afPacketRing(ifn, liveFilter, SNAP_LEN,
+                                                    afCfg);
+                    } else {
+                        li->snif = new liveSniffer(ifn, liveFilter,
+                                                   hwTimestamps, several);
+                        pcap_t* ph = li->snif->get_pcap_handle();
+                        li->dlt = pcap_datalink(ph);
+                        if (pcap_get_tstamp_precision(ph) ==
+                            PCAP_TSTAMP_PRECISION_NANO) {
+                            li->nsMul = 1;
+                        }
+                        char err[PCAP_ERRBUF_SIZE];
+                        if (several && !rawParseDlt(li->dlt)) {
+                            throw std::runtime_error(std::string("link type ") +
+                                      pcap_datalink_val_to_name(li->dlt) +
+                                      " not supported with several interfaces");
+                        }
+                        if (several && pcap_setnonblock(ph, 1, err) < 0) {
+                            throw std::runtime_error(err);
+                        }
+                    }
+                    // count what the prefilter drops with a socket of its
+                    // own (whose filter is compiled for Ethernet framing)
+                    if (tsPrefilter && li->dlt == DLT_EN10MB) {
+                        try {
+                            li->tsFiltered = new afPacketCounter(ifn,
+                                             filter + " and not (" + tsFilter + ")");
+                            tsCounted = true;
+                        } catch (std::runtime_error& ex) {
+                            std::cerr << "WARNING: not counting the packets "
+                                         "the kernel filters out on " << ifn
+                                      << ": " << ex.what() << "\n";
+                        }
+                    }
+                    liveIfs.push_back(std::move(li));
+                    nLiveIfs = liveIfs.size();
+                }
+                if (useBpf) {
+#ifdef PPING_WITH_BPF
+                    // (the pcap filter doesn't apply; the program sees
+                    // everything on the interface)
+                    bpfm = openBpf(fname);
+#endif
+                } else if (!several) {
+                    // one interface is read by the loops below
+                    snif = liveIfs[0]->snif;
+                    afRing = liveIfs[0]->ring;
+                }
+            } else if (inFiles.size() > 1) {
+                fileMerge = new pcapMerge(inFiles, filter);
+                for (int dlt : fileMerge->dlts()) {
+                    if (!rawParseDlt(dlt)) {
+                        throw std::runtime_error(std::string("link type ") +
+                                  pcap_datalink_val_to_name(dlt) +
+                                  " not supported with several files");
                     }
                 }
             } else {
-                snif = new FileSniffer(fname, config);
+                // read frames straight from the (mapped) file unless the
+                // raw parser can't take its link type
+                try {
+                    inFile = new capFile(fname);
+                } catch (std::runtime_error&) {
+                    // (not one capFile reads; see what libpcap can do)
+                }
+                if (inFile && rawParseDlt(inFile->dlt())) {
+                    inFilter = new capFilter(filter);
+                    inFilter->prepare(inFile->dlt());
+                } else {
+                    delete inFile;
+                    inFile = nullptr;
+                    snif = new FileSniffer(fname, config);
+                }
             }
         } catch (std::exception& ex) {
             std::cerr << "Couldn't open " << fname << ": " << ex.what() << "\n";
-            if (snif != nullptr) {
+            if (liveIfs.empty() && snif != nullptr) {
                 delete snif;
             }
+            delete inFile;
+            delete fileMerge;
 
             exit(EXIT_FAILURE);
         }
@@ -666,44 +3182,168 @@ int main(int argc, char* const* argv)
         flushInt /= 100;
     }
 
-    double nxtSum = 0.;
-
-    // Start stdout flush loop / thread
-    std::thread flushLoopThread = std::thread(flushLoop);
+    // Start the output writer, with a queue per flow table worker (the
+    // eBPF matcher uses the first)
+    sampleFormatter fmt = machineReadable ? fmtMachine : fmtHuman;
+    if (outFormat == "csv") {
+        fmt = fmtCsv;
+    } else if (outFormat == "binary") {
+        fmt = fmtBinary;
+    }
+    sampleOut = new sampleWriter(STDOUT_FILENO, fmt, workers.size(), flushInt);
+    if (outFormat == "csv") {
+        sampleOut->preamble(CSV_HEADER, strlen(CSV_HEADER));
+    } else if (outFormat == "binary") {
+        sampleFileHeader h{};
+        memcpy(h.magic, SAMPLE_MAGIC, sizeof(h.magic));
+        h.version = 1;
+        h.recordSize = sizeof(sampleRecord);
+        sampleOut->preamble(&h, sizeof(h));
+    }
+    sampleOut->start();
     std::cerr << "Output interval is: " << flushInt << " us" << std::endl;
 
-    // Start flow clean-up loop / thread
-    std::thread cleanUpLoopThread = std::thread(cleanUpLoop);
-
-    for (const auto& packet : *snif) {
-        process_packet(packet);
+    // Start the flow table workers. With a single worker, packets are
+    // processed directly on the capture thread.
+    if (workers.size() > 1) {
+        for (auto& w : workers) {
+            w->ring.reset(new spscRing<pktInfo>(1 << 16));
+            w->thread = std::thread(&ppWorker::run, w.get());
+        }
+    }
 
-        if ((time_to_run > 0. && capTm - startm >= time_to_run) ||
-            (maxPackets > 0 && pktCnt >= maxPackets)) {
-            printSummary();
-            std::cerr << "Captured " << pktCnt << " packets in "
-                      << (capTm - startm) << " seconds\n";
-            break;
+#ifdef PPING_WITH_BPF
+    if (bpfm) {
+        double now = clockSecs(CLOCK_REALTIME);
+        bpfClockOffNs = clockNs(CLOCK_REALTIME) - clockNs(CLOCK_MONOTONIC);
+        offTm = int64_t(now);
+        startm = now - double(offTm);
+        capTm = startm;
+        bpfSeriesWheel.reset(new expiryWheel<flowKey>(
+                                 std::max(flowMaxIdle, 1e-3) / (WHEEL_BUCKETS / 2),
+                                 WHEEL_BUCKETS));
+        bpfLoop();
+        delete bpfm;    // detaches the program
+        bpfm = nullptr;
+    } else
+#endif
+    if (liveIfs.size() > 1) {
+        captureIfs();
+    } else if (afRing) {
+        while (!gINTERRUPTED &&
+               afRing->next(250, burstMax(), [](const frameSpan* f, size_t n) {
+                   process_burst(f, n);
+                   return afterPacket();
+               })) {
+            idleTick();
+            if (!afterPacket()) {
+                break;
+            }
+        }
+    } else if (inFile) {
+        // frames of a mapped file stay put, so they're parsed in bursts;
+        // a decompressed frame only lasts till the next is read
+        size_t maxBurst = inFile->mapped() ? BURST : 1;
+        burstFrame b[BURST];
+        capFrame f;
+        bool more = true;
+        while (more && !gINTERRUPTED) {
+            size_t n = 0;
+            size_t max = std::min(maxBurst, burstMax());
+            while (n < max && (more = inFile->next(f))) {
+                // (a pcapng interface of another link type, or one the
+                // filter doesn't compile for, is skipped without
+                // filtering it)
+                if (!rawParseDlt(f.dlt) || !inFilter->compiles(f.dlt)) {
+                    pktCnt++;
+                    not_v4or6++;
+                    continue;
+                }
+                if (!inFilter->match(f)) {
+                    continue;
+                }
+                b[n++] = burstFrame{f.data, f.caplen, f.dlt, f.sec, f.nsec};
+            }
+            process_burst(b, n);
+            if (!afterPacket()) {
+                break;
+            }
+        }
+        if (!inFile->error().empty()) {
+            std::cerr << inFile->error() << "\n";
+        }
+        if (!inFilter->error().empty()) {
+            std::cerr << inFilter->error() << "\n";
+        }
+        delete inFile;
+        delete inFilter;
+        inFile = nullptr;
+        inFilter = nullptr;
+    } else if (fileMerge) {
+        fileMerge->run([](const mergedFrame& f) {
+            if (rawParseDlt(f.dlt)) {
+                process_frame(f.data, f.caplen, f.dlt, f.sec, f.nsec);
+            } else {
+                pktCnt++;
+                not_v4or6++;
+            }
+            return afterPacket() && !gINTERRUPTED;
+        });
+        delete fileMerge;
+        fileMerge = nullptr;
+    } else if (rawParseDlt(pcap_datalink(snif->get_pcap_handle()))) {
+        // take the raw frames straight from libpcap rather than having
+        // libtins build a PDU tree for each
+        pcap_t* ph = snif->get_pcap_handle();
+        int dlt = pcap_datalink(ph);
+        int64_t nsMul = (pcap_get_tstamp_precision(ph) ==
+                         PCAP_TSTAMP_PRECISION_NANO) ? 1 : 1000;
+        struct pcap_pkthdr* hdr;
+        const u_char* data;
+        int r;
+        while (!gINTERRUPTED && (r = pcap_next_ex(ph, &hdr, &data)) >= 0) {
+            if (r == 0) {
+                // live capture read timeout
+                idleTick();
+                if (!afterPacket()) {
+                    break;
+                }
+                continue;
+            }
+            process_frame(data, hdr->caplen, dlt, hdr->ts.tv_sec,
+                          hdr->ts.tv_usec * nsMul);
+            if (!afterPacket()) {
+                break;
+            }
         }
-        if (capTm >= nxtSum && sumInt) {
-            if (nxtSum > 0.) {
-                printSummary();
-                pktCnt = 0;
-                no_TS = 0;
-                uniDir = 0;
-                not_tcp = 0;
-                not_v4or6 = 0;
+    } else {
+        for (const auto& packet : *snif) {
+            process_packet(packet);
+            if (!afterPacket()) {
+                break;
             }
-            nxtSum = capTm + sumInt;
         }
     }
 
-    // Force clean-up of all data structures by adding to capTm
-    cleanUp(capTm + (tsvalMaxAge > flowMaxIdle ? tsvalMaxAge : flowMaxIdle) + 1);
+    captureDone = true;
+    for (auto& w : workers) {
+        if (w->thread.joinable()) {
+            w->thread.join();
+        }
+    }
+    if (!snapFile.empty()) {
+        saveSnapshot(true);
+    }
+    for (auto& w : workers) {
+        // Force clean-up of all data structures by adding to capTm
+        w->cleanUp(capTm + (tsvalMaxAge > flowMaxIdle ? tsvalMaxAge : flowMaxIdle) + 1);
+    }
 
-    flushLoopThread.join();
-    cleanUpLoopThread.join();
-    std::cout << std::endl;
+    gINTERRUPTED = true;
+    sampleOut->stop();
+    delete sampleOut;
+    metricsOut->stop();
+    delete metricsOut;
 
     exit(0);
 }
@@ -0,0 +1,451 @@
+/**********************************************************************
+ promexport.h - in-process Prometheus metrics for pping-exporter
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ A minimal metrics registry and /metrics HTTP endpoint, in place of the
+ Go client library. Each series is a handle that flows resolve once and
+ keep; an Observe() is a few relaxed stores into the series, with no
+ locking, allocation or label lookup. This relies on each series having
+ a single writer thread, so every writer (flow table worker) has its
+ own metricShard and series with the same labels in different shards
+ are merged when the metrics are rendered at scrape time.
+
+ Summary quantiles are computed at scrape time over a window of each
+ series' most recent samples (SUMMARY_WINDOW per shard). Histograms have
+ a fixed set of log-linear buckets (histBounds): constant memory per
+ series, an observe is one increment of the sample's bucket, and unlike
+ quantiles the buckets can be summed across series and exporters.
+
+  ***********************************************************************/
+
+#ifndef PPING_PROMEXPORT_H
+#define PPING_PROMEXPORT_H
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define SUMMARY_WINDOW 256          // samples kept per series (power of 2)
+
+// Histogram buckets: below HIST_BASE, then HIST_SUB linear steps in each
+// of HIST_OCTAVES powers of two above it (10us .. 168s for RTTs in ms)
+#define HIST_BASE 0.01
+#define HIST_SUB 4
+#define HIST_OCTAVES 24
+#define HIST_BUCKETS (1 + HIST_SUB * HIST_OCTAVES)  // plus +Inf
+
+enum metricType {
+    METRIC_SUMMARY,
+    METRIC_HISTOGRAM
+};
+
+// upper bounds ('le') of the histogram buckets
+struct histBuckets
+{
+    double le[HIST_BUCKETS];
+
+    constexpr histBuckets() : le{}
+    {
+        le[0] = HIST_BASE;
+        double oct = HIST_BASE;
+        for (int o = 0; o < HIST_OCTAVES; o++) {
+            for (int s = 1; s <= HIST_SUB; s++) {
+                le[1 + o * HIST_SUB + s - 1] = oct * (1. + double(s) / HIST_SUB);
+            }
+            oct *= 2.;
+        }
+    }
+};
+static constexpr histBuckets histBounds{};
+
+// index of the bucket holding v (HIST_BUCKETS is the +Inf bucket)
+static inline int histBucket(double v)
+{
+    if (!(v >= HIST_BASE)) {
+        return 0;
+    }
+    int e;
+    double m = std::frexp(v / HIST_BASE, &e);   // v/base = m * 2^e, m in [.5,1)
+    int b = 1 + (e - 1) * HIST_SUB + int((2. * m - 1.) * HIST_SUB);
+    if (b > HIST_BUCKETS) {
+        return HIST_BUCKETS;
+    }
+    // a value right on a bound belongs to the bucket below it
+    return v <= histBounds.le[b - 1] ? b - 1 : b;
+}
+
+// One labelled series of a summary or histogram. Written by one thread
+// only.
+class rttSeries
+{
+  public:
+    rttSeries(std::string lbls, metricType type) : labels{std::move(lbls)}
+    {
+        if (type == METRIC_HISTOGRAM) {
+            hist_.reset(new std::atomic<uint64_t>[HIST_BUCKETS + 1]());
+        } else {
+            window_.reset(new std::atomic<double>[SUMMARY_WINDOW]());
+        }
+    }
+
+    void observe(double v)
+    {
+        uint64_t n = count_.load(std::memory_order_relaxed);
+        if (hist_) {
+            auto& b = hist_[histBucket(v)];
+            b.store(b.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+        } else {
+            window_[n & (SUMMARY_WINDOW - 1)].store(v, std::memory_order_relaxed);
+        }
+        sum_.store(sum_.load(std::memory_order_relaxed) + v,
+                   std::memory_order_relaxed);
+        count_.store(n + 1, std::memory_order_release);
+    }
+
+    // add this series' count and sum, and its samples (summary) or
+    // bucket counts (histogram, 'hist' has HIST_BUCKETS + 1 entries)
+    void collect(std::vector<double>& win, std::vector<uint64_t>& hist,
+                 uint64_t& count, double& sum) const
+    {
+        uint64_t n = count_.load(std::memory_order_acquire);
+        if (hist_) {
+            for (int i = 0; i <= HIST_BUCKETS; i++) {
+                hist[i] += hist_[i].load(std::memory_order_relaxed);
+            }
+        } else {
+            uint64_t w = std::min<uint64_t>(n, SUMMARY_WINDOW);
+            for (uint64_t i = 0; i < w; i++) {
+                win.push_back(window_[i].load(std::memory_order_relaxed));
+            }
+        }
+        count += n;
+        sum += sum_.load(std::memory_order_relaxed);
+    }
+
+    const std::string labels;   // rendered: name="value",...
+    int refs{};                 // handles held (under the shard's lock)
+
+  private:
+    std::atomic<uint64_t> count_{0};
+    std::atomic<double> sum_{0.};
+    std::unique_ptr<std::atomic<double>[]> window_;     // summary
+    std::unique_ptr<std::atomic<uint64_t>[]> hist_;     // histogram
+};
+
+// The series of one writer thread. acquire() / release() lock (they run
+// once per flow); observing through a handle doesn't.
+class metricShard
+{
+  public:
+    explicit metricShard(metricType type) : type_{type} {}
+
+    rttSeries* acquire(const std::string& labels)
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        auto& s = series_[labels];
+        if (!s) {
+            s.reset(new rttSeries(labels, type_));
+        }
+        s->refs++;
+        return s.get();
+    }
+
+    // drop a handle; the series goes away with its last one
+    void release(rttSeries* s)
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        if (--s->refs == 0) {
+            series_.erase(series_.find(s->labels));
+        }
+    }
+
+    template <class Fn>
+    void forEach(Fn fn)
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        for (const auto& kv : series_) {
+            fn(*kv.second);
+        }
+    }
+
+  private:
+    metricType type_;
+    std::mutex mtx_;
+    std::unordered_map<std::string, std::unique_ptr<rttSeries>> series_;
+};
+
+// Render a label set, escaping the values as the text format requires
+static inline std::string promLabels(const std::vector<std::string>& names,
+                                     const std::vector<std::string>& values)
+{
+    std::string s;
+    for (size_t i = 0; i < names.size() && i < values.size(); i++) {
+        if (i > 0) {
+            s += ',';
+        }
+        s += names[i];
+        s += "=\"";
+        for (char c : values[i]) {
+            switch (c) {
+            case '\\': s += "\\\\"; break;
+            case '"':  s += "\\\""; break;
+            case '\n': s += "\\n"; break;
+            default:   s += c;
+            }
+        }
+        s += '"';
+    }
+    return s;
+}
+
+// Append a sample value: the shortest of %.15g / %.17g that reads back
+// as the same double
+static inline void promValue(std::string& out, double v)
+{
+    char buf[32];
+    if (std::isnan(v)) {
+        out += "NaN";
+        return;
+    }
+    snprintf(buf, sizeof(buf), "%.15g", v);
+    if (strtod(buf, nullptr) != v) {
+        snprintf(buf, sizeof(buf), "%.17g", v);
+    }
+    out += buf;
+}
+
+// Append a counter or gauge metric 'name' of type 'type' with one sample
+// per (rendered labels, value) pair
+static inline void promSimple(std::string& out, const std::string& name,
+                              const char* type, const std::string& help,
+                              const std::vector<std::pair<std::string, double>>& series)
+{
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " " + type + "\n";
+    for (const auto& s : series) {
+        out += name;
+        if (!s.first.empty()) {
+            out += "{" + s.first + "}";
+        }
+        out += ' ';
+        promValue(out, s.second);
+        out += '\n';
+    }
+}
+
+// A summary or histogram metric, sharded by writer thread
+class metricFamily
+{
+  public:
+    // 'quantiles' are only used by summaries
+    metricFamily(std::string name, std::string help, metricType type,
+                 std::vector<double> quantiles, size_t nShards)
+        : name_{std::move(name)}, help_{std::move(help)}, type_{type},
+          quantiles_{std::move(quantiles)}
+    {
+        for (size_t i = 0; i < nShards; i++) {
+            shards_.emplace_back(new metricShard(type));
+        }
+    }
+
+    metricShard& shard(size_t i) { return *shards_[i]; }
+
+    // append the family in the Prometheus text exposition format
+    void render(std::string& out)
+    {
+        struct agg {
+            std::vector<double> win;
+            std::vector<uint64_t> hist = std::vector<uint64_t>(HIST_BUCKETS + 1);
+            uint64_t count{};
+            double sum{};
+        };
+        std::map<std::string, agg> merged;
+        for (auto& sh : shards_) {
+            sh->forEach([&merged](const rttSeries& s) {
+                agg& a = merged[s.labels];
+                s.collect(a.win, a.hist, a.count, a.sum);
+            });
+        }
+
+        bool isHist = (type_ == METRIC_HISTOGRAM);
+        out += "# HELP " + name_ + " " + help_ + "\n";
+        out += "# TYPE " + name_ + (isHist ? " histogram\n" : " summary\n");
+        for (auto& kv : merged) {
+            const std::string& lbl = kv.first;
+            const std::string sep = lbl.empty() ? "" : ",";
+            agg& a = kv.second;
+            if (isHist) {
+                // buckets are cumulative in the exposition format
+                uint64_t cum = 0;
+                for (int i = 0; i <= HIST_BUCKETS; i++) {
+                    cum += a.hist[i];
+                    out += name_ + "_bucket{" + lbl + sep + "le=\"";
+                    if (i < HIST_BUCKETS) {
+                        promValue(out, histBounds.le[i]);
+                    } else {
+                        out += "+Inf";
+                    }
+                    out += "\"} " + std::to_string(cum) + "\n";
+                }
+            } else {
+                std::sort(a.win.begin(), a.win.end());
+                for (double q : quantiles_) {
+                    double v = NAN;
+                    if (!a.win.empty()) {
+                        size_t r = size_t(std::ceil(q * a.win.size()));
+                        v = a.win[r > 0 ? r - 1 : 0];
+                    }
+                    out += name_ + "{" + lbl + sep + "quantile=\"";
+                    promValue(out, q);
+                    out += "\"} ";
+                    promValue(out, v);
+                    out += '\n';
+                }
+            }
+            std::string sel = lbl.empty() ? "" : "{" + lbl + "}";
+            out += name_ + "_sum" + sel + " ";
+            promValue(out, a.sum);
+            out += '\n';
+            out += name_ + "_count" + sel + " " + std::to_string(a.count) + "\n";
+        }
+    }
+
+  private:
+    std::string name_;
+    std::string help_;
+    metricType type_;
+    std::vector<double> quantiles_;
+    std::vector<std::unique_ptr<metricShard>> shards_;
+};
+
+// Serves GET <path> with whatever render() returns, one connection at
+// a time, on a thread of its own.
+class metricsServer
+{
+  public:
+    template <class Fn>
+    metricsServer(const std::string& addr, const std::string& path, Fn render)
+    {
+        // "host:port", ":port" or "[v6addr]:port"
+        auto colon = addr.rfind(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("bad listen address " + addr);
+        }
+        std::string host = addr.substr(0, colon);
+        std::string port = addr.substr(colon + 1);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int err = getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                              port.c_str(), &hints, &res);
+        if (err != 0) {
+            throw std::runtime_error("bad listen address " + addr + ": " +
+                                     gai_strerror(err));
+        }
+        fd_ = socket(res->ai_family, SOCK_STREAM, 0);
+        int one = 1;
+        if (fd_ < 0 ||
+            setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            bind(fd_, res->ai_addr, res->ai_addrlen) < 0 ||
+            listen(fd_, 16) < 0) {
+            std::string e = strerror(errno);
+            freeaddrinfo(res);
+            if (fd_ >= 0) {
+                close(fd_);
+            }
+            throw std::runtime_error("can't listen on " + addr + ": " + e);
+        }
+        freeaddrinfo(res);
+
+        // (never joined; it runs until the program exits)
+        std::thread([this, path, render]() {
+            for (;;) {
+                int c = accept(fd_, nullptr, nullptr);
+                if (c < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return;
+                }
+                serve(c, path, render);
+                close(c);
+            }
+        }).detach();
+    }
+
+  private:
+    template <class Fn>
+    static void serve(int c, const std::string& path, const Fn& render)
+    {
+        struct timeval tv = {2, 0};
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        // only the request line matters
+        std::string req;
+        char buf[1024];
+        while (req.find("\r\n\r\n") == std::string::npos && req.size() < 8192) {
+            ssize_t n = recv(c, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                break;
+            }
+            req.append(buf, n);
+        }
+        std::string status = "200 OK", body;
+        auto sp = req.find(' ');
+        auto sp2 = req.find_first_of(" ?", sp + 1);
+        if (req.compare(0, 4, "GET ") != 0 || sp2 == std::string::npos) {
+            status = "400 Bad Request";
+        } else if (req.compare(sp + 1, sp2 - sp - 1, path) != 0) {
+            status = "404 Not Found";
+        } else {
+            body = render();
+        }
+        std::string resp = "HTTP/1.1 " + status + "\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: " + std::to_string(body.size()) +
+                           "\r\nConnection: close\r\n\r\n" + body;
+        for (size_t off = 0; off < resp.size(); ) {
+            ssize_t n = send(c, resp.data() + off, resp.size() - off, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            off += n;
+        }
+    }
+
+    int fd_{-1};
+};
+
+#endif
@@ -0,0 +1,182 @@
+/**********************************************************************
+ rttstats.h - constant-space streaming RTT statistics of a flow
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ An rttStats lives in each flow record and is updated with every RTT the
+ flow matches, on the worker thread, without allocating:
+  - a smoothed RTT and its variance, exponentially weighted with gain
+    RTTSTATS_GAIN (1/8, as TCP's SRTT),
+  - the min, max and count of the current window,
+  - the window's median and 95th percentile, each estimated with the
+    P-squared algorithm (Jain & Chlamtac, 1985): five markers whose
+    heights are nudged towards the quantile as samples arrive.
+ The window is whatever is between two calls of endWindow(); the
+ smoothed values carry over from one window to the next.
+
+  ***********************************************************************/
+
+#ifndef PPING_RTTSTATS_H
+#define PPING_RTTSTATS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#define RTTSTATS_GAIN 0.125
+
+// P-squared estimate of quantile 'p' of a stream
+class p2Quantile
+{
+  public:
+    explicit p2Quantile(double p = 0.5) : p_{p} { reset(); }
+
+    void reset()
+    {
+        n_ = 0;
+        for (int i = 0; i < 5; i++) {
+            pos_[i] = i + 1;
+        }
+        want_[0] = 1.;
+        want_[1] = 1. + 2. * p_;
+        want_[2] = 1. + 4. * p_;
+        want_[3] = 3. + 2. * p_;
+        want_[4] = 5.;
+    }
+
+    void add(double x)
+    {
+        if (n_ < 5) {
+            // the first five samples are the initial markers
+            q_[n_++] = x;
+            if (n_ == 5) {
+                std::sort(q_, q_ + 5);
+            }
+            return;
+        }
+        n_++;
+        int k;
+        if (x < q_[0]) {
+            q_[0] = x;
+            k = 0;
+        } else if (x >= q_[4]) {
+            q_[4] = x;
+            k = 3;
+        } else {
+            for (k = 0; x >= q_[k + 1]; k++) {
+            }
+        }
+        for (int i = k + 1; i < 5; i++) {
+            pos_[i]++;
+        }
+        const double inc[5] = {0., p_ / 2., p_, (1. + p_) / 2., 1.};
+        for (int i = 0; i < 5; i++) {
+            want_[i] += inc[i];
+        }
+        // move the middle markers that are off their desired positions
+        for (int i = 1; i < 4; i++) {
+            double d = want_[i] - pos_[i];
+            if ((d >= 1. && pos_[i + 1] - pos_[i] > 1) ||
+                (d <= -1. && pos_[i - 1] - pos_[i] < -1)) {
+                int s = (d > 0.) ? 1 : -1;
+                double h = parabolic(i, s);
+                if (q_[i - 1] < h && h < q_[i + 1]) {
+                    q_[i] = h;
+                } else {
+                    q_[i] += s * (q_[i + s] - q_[i]) / (pos_[i + s] - pos_[i]);
+                }
+                pos_[i] += s;
+            }
+        }
+    }
+
+    // the estimate (NaN if there were no samples)
+    double value() const
+    {
+        if (n_ >= 5) {
+            return q_[2];
+        }
+        if (n_ == 0) {
+            return NAN;
+        }
+        double v[5];
+        std::copy(q_, q_ + n_, v);
+        std::sort(v, v + n_);
+        return v[std::min<uint32_t>(n_ - 1, uint32_t(p_ * n_))];
+    }
+
+  private:
+    double parabolic(int i, int s) const
+    {
+        double n0 = pos_[i - 1], n1 = pos_[i], n2 = pos_[i + 1];
+        return q_[i] + s / (n2 - n0) *
+               ((n1 - n0 + s) * (q_[i + 1] - q_[i]) / (n2 - n1) +
+                (n2 - n1 - s) * (q_[i] - q_[i - 1]) / (n1 - n0));
+    }
+
+    double p_;
+    uint32_t n_;
+    double q_[5];       // marker heights
+    int32_t pos_[5];    // marker positions (1-based)
+    double want_[5];    // desired positions
+};
+
+class rttStats
+{
+  public:
+    void add(double rtt)
+    {
+        if (total_++ == 0) {
+            srtt_ = rtt;
+            var_ = 0.;
+        } else {
+            // incremental exponentially weighted mean and variance
+            double d = rtt - srtt_;
+            double inc = RTTSTATS_GAIN * d;
+            srtt_ += inc;
+            var_ = (1. - RTTSTATS_GAIN) * (var_ + d * inc);
+        }
+        if (n_++ == 0 || rtt < min_) {
+            min_ = rtt;
+        }
+        if (n_ == 1 || rtt > max_) {
+            max_ = rtt;
+        }
+        p50_.add(rtt);
+        p95_.add(rtt);
+    }
+
+    // samples in the current window
+    uint32_t count() const { return n_; }
+
+    double srtt() const { return srtt_; }
+    double stddev() const { return std::sqrt(var_); }
+    double min() const { return min_; }
+    double max() const { return max_; }
+    double p50() const { return p50_.value(); }
+    double p95() const { return p95_.value(); }
+
+    void endWindow()
+    {
+        n_ = 0;
+        p50_.reset();
+        p95_.reset();
+    }
+
+  private:
+    uint64_t total_{};
+    double srtt_{};
+    double var_{};
+    uint32_t n_{};
+    double min_{};
+    double max_{};
+    p2Quantile p50_{0.5};
+    p2Quantile p95_{0.95};
+};
+
+#endif
@@ -0,0 +1,76 @@
+/**********************************************************************
+ spscring.h - bounded lock-free single-producer / single-consumer queue
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+  ***********************************************************************/
+
+#ifndef PPING_SPSCRING_H
+#define PPING_SPSCRING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded single-producer / single-consumer ring. Each side keeps a
+// cached copy of the other side's index so the shared cache lines are
+// only touched when the cached value says the ring looks full / empty.
+template <class T>
+class spscRing
+{
+  public:
+    explicit spscRing(size_t cap) : mask_{cap - 1}, buf_(cap) {}  // cap: power of 2
+
+    bool push(const T& v)
+    {
+        size_t t = tail_.load(std::memory_order_relaxed);
+        if (t - headCache_ > mask_) {
+            headCache_ = head_.load(std::memory_order_acquire);
+            if (t - headCache_ > mask_) {
+                return false;
+            }
+        }
+        buf_[t & mask_] = v;
+        tail_.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // pop up to 'max' items into 'out', returns the number popped
+    size_t pop(T* out, size_t max)
+    {
+        size_t h = head_.load(std::memory_order_relaxed);
+        if (tailCache_ == h) {
+            tailCache_ = tail_.load(std::memory_order_acquire);
+            if (tailCache_ == h) {
+                return 0;
+            }
+        }
+        size_t n = std::min(max, tailCache_ - h);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = buf_[(h + i) & mask_];
+        }
+        head_.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+  private:
+    // the padding keeps the consumer and producer sides on separate
+    // cache lines
+    const size_t mask_;
+    std::vector<T> buf_;
+    char pad0_[64];
+    std::atomic<size_t> head_{0};   // consumer side
+    size_t tailCache_{0};
+    char pad1_[64];
+    std::atomic<size_t> tail_{0};   // producer side
+    size_t headCache_{0};
+    char pad2_[64];
+};
+
+#endif
@@ -0,0 +1,249 @@
+/**********************************************************************
+ tcpparse.h - allocation-free TCP timestamp option parser for pping
+
+ Copyright (C) 2020  Thomas Lin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+ Walks the link-layer (Ethernet with optional VLAN tags, Linux cooked,
+ BSD loopback or raw IP), IPv4 / IPv6 (including the common extension
+ headers) and TCP headers of a captured frame in place and extracts
+ what pping needs: addresses, ports, flags, sequence and ACK numbers,
+ TSval/ECR and the packet's length. Nothing is allocated and nothing
+ throws, so packets without a timestamp option cost a few comparisons.
+
+ Encapsulations it doesn't know (MPLS, PPPoE, tunnels, other link types)
+ are reported as PARSE_FALLBACK so the caller can hand the frame to
+ libtins instead.
+
+  ***********************************************************************/
+
+#ifndef PPING_TCPPARSE_H
+#define PPING_TCPPARSE_H
+
+#include <netinet/in.h>
+#include <pcap.h>
+#include <cstdint>
+#include <cstring>
+
+enum parseResult {
+    PARSE_OK,
+    PARSE_NOT_TCP,
+    PARSE_NO_TS,
+    PARSE_NOT_V4_OR_6,
+    PARSE_FALLBACK      // not understood here, use libtins
+};
+
+struct tcpTsFields
+{
+    const uint8_t* src;     // IP addresses (4 or 16 bytes, network order)
+    const uint8_t* dst;
+    bool v6;
+    uint16_t sport;
+    uint16_t dport;
+    uint16_t flags;         // TCP flags, as libtins' TCP::flags()
+    uint32_t seq;
+    uint32_t ack;
+    uint32_t dataLen;       // TCP payload bytes (from the IP length)
+    uint32_t tsval;
+    uint32_t ecr;
+    uint32_t wireLen;       // link header + IP length (not capped by snaplen)
+};
+
+static inline uint16_t rd16(const uint8_t* p)
+{
+    return uint16_t((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t rd32(const uint8_t* p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+           (uint32_t(p[2]) << 8) | p[3];
+}
+
+// Fill 'out' from the TCP header at tcp (with 'avail' captured bytes,
+// of the 'segLen' the IP header gives the segment).
+static inline parseResult parseTcp(const uint8_t* tcp, uint32_t avail,
+                                   uint32_t segLen, tcpTsFields& out)
+{
+    if (avail < 20) {
+        return PARSE_NOT_TCP;
+    }
+    uint32_t hlen = (tcp[12] >> 4) * 4u;
+    if (hlen < 20) {
+        return PARSE_NOT_TCP;
+    }
+    out.sport = rd16(tcp);
+    out.dport = rd16(tcp + 2);
+    out.flags = uint16_t(((tcp[12] & 0x0f) << 8) | tcp[13]);
+    out.seq = rd32(tcp + 4);
+    out.ack = rd32(tcp + 8);
+    out.dataLen = segLen > hlen ? segLen - hlen : 0;
+
+    // scan the options for kind 8 (timestamp, length 10)
+    uint32_t end = hlen < avail ? hlen : avail;
+    for (uint32_t i = 20; i < end; ) {
+        uint8_t kind = tcp[i];
+        if (kind == 0) {            // end of options
+            break;
+        }
+        if (kind == 1) {            // NOP
+            i++;
+            continue;
+        }
+        if (i + 1 >= end || tcp[i + 1] < 2) {
+            break;                  // truncated or malformed
+        }
+        uint32_t olen = tcp[i + 1];
+        if (kind == 8 && olen == 10 && i + 10 <= end) {
+            out.tsval = rd32(tcp + i + 2);
+            out.ecr = rd32(tcp + i + 6);
+            return PARSE_OK;
+        }
+        i += olen;
+    }
+    return PARSE_NO_TS;
+}
+
+// Parse from the IP header at ip. 'l2len' is the size of the link
+// headers in front of it (counted in wireLen).
+static inline parseResult parseIp(const uint8_t* ip, uint32_t avail,
+                                  uint32_t l2len, tcpTsFields& out)
+{
+    if (avail < 1) {
+        return PARSE_NOT_V4_OR_6;
+    }
+    uint8_t ver = ip[0] >> 4;
+    if (ver == 4) {
+        if (avail < 20) {
+            return PARSE_NOT_TCP;
+        }
+        uint32_t ihl = (ip[0] & 0x0f) * 4u;
+        // no TCP header in later fragments
+        if (ihl < 20 || ip[9] != IPPROTO_TCP || (rd16(ip + 6) & 0x1fff) != 0) {
+            return PARSE_NOT_TCP;
+        }
+        if (avail < ihl) {
+            return PARSE_NOT_TCP;
+        }
+        out.src = ip + 12;
+        out.dst = ip + 16;
+        out.v6 = false;
+        uint32_t ipLen = rd16(ip + 2);
+        out.wireLen = l2len + ipLen;
+        return parseTcp(ip + ihl, avail - ihl, ipLen > ihl ? ipLen - ihl : 0,
+                        out);
+    }
+    if (ver == 6) {
+        if (avail < 40) {
+            return PARSE_NOT_TCP;
+        }
+        out.src = ip + 8;
+        out.dst = ip + 24;
+        out.v6 = true;
+        out.wireLen = l2len + 40 + rd16(ip + 4);
+
+        // skip the extension headers in front of TCP
+        uint8_t nh = ip[6];
+        uint32_t off = 40;
+        for (;;) {
+            if (nh == IPPROTO_TCP) {
+                uint32_t ipLen = 40 + rd16(ip + 4);
+                return parseTcp(ip + off, avail - off,
+                                ipLen > off ? ipLen - off : 0, out);
+            }
+            if (off + 8 > avail) {
+                return PARSE_NOT_TCP;
+            }
+            const uint8_t* eh = ip + off;
+            switch (nh) {
+            case IPPROTO_HOPOPTS:
+            case IPPROTO_ROUTING:
+            case IPPROTO_DSTOPTS:
+                off += (eh[1] + 1) * 8u;
+                break;
+            case IPPROTO_FRAGMENT:
+                if ((rd16(eh + 2) & 0xfff8) != 0) {
+                    return PARSE_NOT_TCP;
+                }
+                off += 8;
+                break;
+            case IPPROTO_AH:
+                off += (eh[1] + 2) * 4u;
+                break;
+            default:
+                return PARSE_NOT_TCP;
+            }
+            nh = eh[0];
+            if (off > avail) {
+                return PARSE_NOT_TCP;
+            }
+        }
+    }
+    return PARSE_NOT_V4_OR_6;
+}
+
+static inline bool rawParseDlt(int dlt)
+{
+    return dlt == DLT_EN10MB || dlt == DLT_LINUX_SLL || dlt == DLT_RAW ||
+           dlt == DLT_IPV4 || dlt == DLT_IPV6 || dlt == DLT_NULL ||
+           dlt == DLT_LOOP;
+}
+
+// Parse a frame of link type 'dlt' with 'caplen' captured bytes.
+static inline parseResult parseTcpTs(const uint8_t* p, uint32_t caplen,
+                                     int dlt, tcpTsFields& out)
+{
+    uint32_t off;
+    uint16_t etype;
+    switch (dlt) {
+    case DLT_EN10MB:
+        if (caplen < 14) {
+            return PARSE_NOT_TCP;
+        }
+        off = 14;
+        etype = rd16(p + 12);
+        // 802.1Q / 802.1ad (QinQ) tags
+        while ((etype == 0x8100 || etype == 0x88a8 || etype == 0x9100) &&
+               off + 4 <= caplen) {
+            etype = rd16(p + off + 2);
+            off += 4;
+        }
+        break;
+    case DLT_LINUX_SLL:
+        if (caplen < 16) {
+            return PARSE_NOT_TCP;
+        }
+        off = 16;
+        etype = rd16(p + 14);
+        break;
+    case DLT_NULL:
+    case DLT_LOOP:
+        if (caplen < 4) {
+            return PARSE_NOT_TCP;
+        }
+        // address family, in host (NULL) or network (LOOP) byte order.
+        // Just look at the IP version instead.
+        return parseIp(p + 4, caplen - 4, 4, out);
+    case DLT_RAW:
+    case DLT_IPV4:
+    case DLT_IPV6:
+        return parseIp(p, caplen, 0, out);
+    default:
+        return PARSE_FALLBACK;
+    }
+    if (etype == 0x0800 || etype == 0x86dd) {
+        return parseIp(p + off, caplen - off, off, out);
+    }
+    // ARP, LLDP, etc can't be TCP; anything else may be an encapsulation
+    // libtins knows about
+    if (etype == 0x0806 || etype == 0x88cc) {
+        return PARSE_NOT_TCP;
+    }
+    return PARSE_FALLBACK;
+}
+
+#endif